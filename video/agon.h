@@ -20,6 +20,7 @@
 #define MAX_BITMAPS				256		// Maximum number of bitmaps
 
 // #define VDP_USE_WDT						// Use the esp watchdog timer (experimental)
+// #define VDP_PROFILING					// Collect command timing and allocation statistics (see profiling.h)
 
 #define UART_BR					1152000	// Max baud rate; previous stable value was 384000
 #define UART_NA					-1
@@ -77,6 +78,9 @@
 #define VDP_CONTEXT				0xC8	// Context management commands
 #define VDP_FLUSH_DRAWING_QUEUE	0xCA	// Flush the drawing queue
 #define VDP_PATTERN_LENGTH		0xF2	// Set pattern length (*FX 163,242,n)
+#define VDP_MEMORY_STATS		0xF6	// Report memory pool and heap statistics
+#define MEMORY_STATS_LOG		0xFF	// Index that reports every class to the debug log
+#define VDP_PROFILE				0xF7	// Profiling statistics (reset/report)
 #define VDP_TESTFLAG_SET		0xF8	// Set a test flag
 #define VDP_TESTFLAG_CLEAR		0xF9	// Clear a test flag
 #define VDP_CONSOLEMODE			0xFE	// Switch console mode on and off
@@ -95,6 +99,7 @@
 #define PACKET_RTC				0x07	// RTC
 #define PACKET_KEYSTATE			0x08	// Keyboard repeat rate and LED status
 #define PACKET_MOUSE			0x09	// Mouse data
+#define PACKET_MEMORY_STATS		0x76	// Memory pool and heap statistics
 
 #define AUDIO_CHANNELS			3		// Default number of audio channels
 #define AUDIO_DEFAULT_SAMPLE_RATE	16384	// Default sample rate
@@ -102,6 +107,9 @@
 #define AUDIO_CHANNEL_PRIORITY	3		// Sound driver task priority with 3 (configMAX_PRIORITIES - 1) being the highest, and 0 being the lowest
 #define AUDIO_CORE				0		// Core to run audio tasks on
 
+#define PARALLEL_WORKER_PRIORITY	2		// Priority of the worker task that shares jobs with the VDU processor
+#define PARALLEL_WORKER_STACK	4096	// Stack size of the worker task
+
 // Audio command definitions
 //
 #define AUDIO_CMD_PLAY			0		// Play a sound
@@ -263,6 +271,8 @@
 #define BUFFERED_REVERSE				0x18	// Reverse the order of data in a buffer
 #define BUFFERED_COPY_REF				0x19	// Copy references to blocks from multiple buffers into one buffer
 #define BUFFERED_COPY_AND_CONSOLIDATE	0x1A	// Copy blocks from multiple buffers into one buffer and consolidate them
+#define BUFFERED_SCATTER_WRITE			0x1B	// Write blocks to multiple buffers from one payload
+#define BUFFERED_WRITE_COMPRESSED		0x1C	// Write compressed data to a buffer, decompressing it as it arrives
 #define BUFFERED_AFFINE_TRANSFORM		0x20	// Create or combine a 3x3 2d affine transform matrix buffer
 #define BUFFERED_AFFINE_TRANSFORM_3D	0x21	// Create or combine a 4x4 3d affine transform matrix buffer
 #define BUFFERED_MATRIX					0x22	// Create or combine a matrix buffer of arbitrary dimensions
@@ -270,6 +280,8 @@
 #define BUFFERED_TRANSFORM_DATA			0x29	// Transform data using a given matrix
 #define BUFFERED_COMPRESS				0x40	// Compress blocks from multiple buffers into one buffer
 #define BUFFERED_DECOMPRESS				0x41	// Decompress blocks from multiple buffers into one buffer
+#define BUFFERED_SET_COMPRESSED			0x42	// Mark a buffer as holding compressed data, to decompress when used
+#define BUFFERED_COMPRESS_WITH			0x43	// Compress blocks from a buffer using a given compression type
 #define BUFFERED_EXPAND_BITMAP			0x48	// Expand a bitmap buffer
 #define BUFFERED_PINGO_3D               0x49    // Configure a 3D scene or render to a bitmap
 
@@ -317,6 +329,11 @@
 #define REVERSE_BLOCK			0x08	// reverse block order
 #define REVERSE_UNUSED_BITS		0xF0	// unused bits
 
+// Compression types
+#define COMPRESS_TURBO			0x00	// TurboVega-style compression, as used by BUFFERED_COMPRESS
+#define COMPRESS_LZ				0x01	// Byte-aligned LZ compression, with a 64KB window - faster to decompress
+#define COMPRESS_TURBO_PARALLEL	0x02	// TurboVega-style compression in independent chunks, compressed and decompressed on both cores
+
 // Expand bitmap operation flags
 #define EXPAND_BITMAP_SIZE		0x07	// bottom bits indicate the number of bits per pixel in bitmap, 0=8bpp
 #define EXPAND_BITMAP_ALIGNED	0x08	// includes pixel width value to indicate where a byte alignment should be performed
@@ -393,6 +410,7 @@
 
 // Test flags
 #define TEST_FLAG_AFFINE_TRANSFORM	1	// Affine transform test flag
+#define TEST_FLAG_FAST_DISPATCH		2	// Dispatch buffered commands from a pre-decoded list when running buffers
 
 #define LOGICAL_SCRW			1280	// As per the BBC Micro standard
 #define LOGICAL_SCRH			1024
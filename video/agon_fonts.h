@@ -42,6 +42,7 @@
 
 #include "agon.h"
 #include "buffers.h"
+#include "decompression_cache.h"
 #include "types.h"
 
 std::unordered_map<uint16_t, std::shared_ptr<fabgl::FontInfo>,
@@ -348,6 +349,10 @@ std::shared_ptr<fabgl::FontInfo> createFontFromBuffer(uint16_t bufferId, uint8_t
 		debug_log("createFontFromBuffer: buffer %d not found\n\r", bufferId);
 		return nullptr;
 	}
+	if (!decompressInPlace(bufferId)) {
+		debug_log("createFontFromBuffer: buffer %d could not be decompressed\n\r", bufferId);
+		return nullptr;
+	}
 	if (buffers[bufferId].size() != 1) {
 		debug_log("createFontFromBuffer: buffer %d is not a singular buffer and cannot be used for a font source\n\r", bufferId);
 		return nullptr;
@@ -366,7 +371,12 @@ std::shared_ptr<fabgl::FontInfo> createFontFromBuffer(uint16_t bufferId, uint8_t
 		return nullptr;
 	}
 
-	auto data = buffers[bufferId][0]->getBuffer();
+	// the font keeps a pointer to the buffer data, so it must stay put
+	auto data = buffers[bufferId][0]->pin();
+	if (!data) {
+		debug_log("createFontFromBuffer: failed to pin buffer %d\n\r", bufferId);
+		return nullptr;
+	}
 
 	auto font = make_shared_psram<fabgl::FontInfo>();
 	font->width = width;
@@ -418,7 +428,7 @@ void setFontInfo(uint16_t bufferId, uint8_t field, uint16_t value) {
 				debug_log("setFontInfo: buffer %d is not a singular buffer and cannot be used for a font character pointer source\n\r", value);
 				return;
 			}
-			font->chptr = (const uint32_t*) (buffers[value][0]->getBuffer());
+			font->chptr = (const uint32_t*) (buffers[value][0]->pin());
 		} break;
 		case FONT_INFO_POINTSIZE: {
 			font->pointSize = (uint8_t) value;
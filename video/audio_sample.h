@@ -77,20 +77,12 @@ void AudioSample::seekTo(uint32_t position, uint32_t & index, uint32_t & blockIn
 		repeatCount = 0;
 	}
 
-	blockIndex = 0;
-	index = position;
-	while (blockIndex < blocks.size() && index >= blocks[blockIndex]->size()) {
-		index -= blocks[blockIndex]->size();
-		blockIndex++;
-	}
+	blockIndex = blocks.findBlock(position);
+	index = position - blocks.blockStart(blockIndex);
 }
 
 uint32_t AudioSample::getSize() {
-	uint32_t samples = 0;
-	for (auto block : blocks) {
-		samples += block->size();
-	}
-	return samples;
+	return blocks.totalSize();
 }
 
 #endif // AUDIO_SAMPLE_H
@@ -6,9 +6,43 @@
 
 #include "types.h"
 
+class BufferStream;
+
+// Data storage for one or more blocks
+//
+// Copying or splitting a block doesn't duplicate its data.  The new blocks
+// share the storage of the original, each covering its own range of it.
+// All blocks using a storage are kept on a list.  Before a block is written
+// to, the list is checked for other blocks that can see the bytes it covers.
+// If there are any, the block first takes a private copy of its range
+// (copy-on-write).
+//
+// Some blocks have their data pointer held long-term, e.g. by bitmaps and
+// fonts, so their data must never move.  Such blocks are pinned.  A block
+// gets private storage when it is pinned.  After that, any new copy that
+// would overlap it is made eagerly instead of being shared.
+//
+struct BlockStorage {
+	BlockStorage(uint32_t length) : data(make_unique_psram_array<uint8_t>(length)), length(length) {}
+
+	psram_unique_array<uint8_t> data;
+	uint32_t		length;
+	BufferStream *	views = nullptr;		// Blocks using this storage
+};
+
+// Guards the lists of blocks using each storage, as blocks may be released on other cores
+portMUX_TYPE blockStorageLock = portMUX_INITIALIZER_UNLOCKED;
+
 class BufferStream : public Stream {
 	public:
 		BufferStream(uint32_t bufferLength);
+		BufferStream(const BufferStream &source, uint32_t offset, uint32_t length);
+		BufferStream(const BufferStream &) = delete;
+		BufferStream &operator=(const BufferStream &) = delete;
+		~BufferStream();
+
+		static std::shared_ptr<BufferStream> share(const std::shared_ptr<BufferStream> &source, uint32_t offset, uint32_t length);
+
 		int available();
 		int read();
 		int peek();
@@ -30,11 +64,20 @@ class BufferStream : public Stream {
 			bufferPosition = position;
 		}
 
-		inline uint8_t * getBuffer() {
-			return buffer.get();
-		}
 		inline const uint8_t * getBuffer() const {
-			return buffer.get();
+			return buffer;
+		}
+		// Access to the data for writing, taking a private copy first if it's shared
+		inline uint8_t * getWritableBuffer() {
+			return makeWritable() ? buffer : nullptr;
+		}
+		// Access to the data for long-term use, after which the data will never move
+		inline uint8_t * pin() {
+			if (!makeWritable()) {
+				return nullptr;
+			}
+			pinned = true;
+			return buffer;
 		}
 		inline uint32_t size() const {
 			return bufferLength;
@@ -42,18 +85,154 @@ class BufferStream : public Stream {
 		inline uint32_t tell() const {
 			return bufferPosition;
 		}
+		// Changes whenever the data may have been written to, except through a pinned pointer
+		inline uint32_t writeCount() const {
+			return writes;
+		}
+		inline bool isPinned() const {
+			return pinned;
+		}
+		// Whether this block's data directly follows the given block's in the same storage
+		inline bool follows(const BufferStream &previous) const {
+			return storage && storage == previous.storage && buffer == previous.buffer + previous.bufferLength;
+		}
 
-		bool writeBuffer(uint8_t * data, uint32_t length, uint32_t offset);
+		bool writeBuffer(const uint8_t * data, uint32_t length, uint32_t offset);
 		void writeBufferByte(uint8_t data, uint32_t offset);
 		bool incrementBufferByte(uint32_t offset, int8_t by);
 	protected:
-		std::unique_ptr<uint8_t[]> buffer;
+		uint8_t * buffer = nullptr;
 		uint32_t bufferLength;
 		uint32_t bufferPosition;
+
+		inline bool makeWritable() {
+			writes++;
+			return (storage && storage->views == this && !nextView) || copyOnWrite();
+		}
+	private:
+		std::shared_ptr<BlockStorage> storage;
+		BufferStream * prevView = nullptr;
+		BufferStream * nextView = nullptr;
+		bool pinned = false;
+		uint32_t writes = 0;
+
+		void attach(std::shared_ptr<BlockStorage> newStorage, uint8_t * data);
+		void detach();
+		bool overlaps(const uint8_t * start, uint32_t length, bool pinnedOnly) const;
+		bool copyOnWrite();
 };
 
 BufferStream::BufferStream(uint32_t bufferLength) : bufferLength(bufferLength), bufferPosition(0) {
-	buffer = make_unique_psram_array<uint8_t>(bufferLength);
+	auto newStorage = make_shared_psram<BlockStorage>(bufferLength);
+	if (newStorage && newStorage->data) {
+		auto data = newStorage->data.get();
+		attach(std::move(newStorage), data);
+	}
+}
+
+// Create a block sharing a range of another block's storage
+// NB use share() rather than this directly, as it checks for pinned blocks
+//
+BufferStream::BufferStream(const BufferStream &source, uint32_t offset, uint32_t length) : bufferLength(length), bufferPosition(0) {
+	attach(source.storage, source.buffer + offset);
+}
+
+BufferStream::~BufferStream() {
+	detach();
+}
+
+// Create a block holding a copy of a range of the source block
+// The range is relative to the start of the source block, and may extend into following blocks
+// that share its storage.  The data is shared until either side is written to, unless the
+// range overlaps a pinned block in which case it's copied now
+//
+std::shared_ptr<BufferStream> BufferStream::share(const std::shared_ptr<BufferStream> &source, uint32_t offset, uint32_t length) {
+	auto start = source->buffer + offset;
+	if (!source->storage || start + length > source->storage->data.get() + source->storage->length) {
+		debug_log("BufferStream::share: range is outside of source storage\n\r");
+		return nullptr;
+	}
+	if (!source->overlaps(start, length, true)) {
+		return make_shared_psram<BufferStream>(*source, offset, length);
+	}
+	auto bufferStream = make_shared_psram<BufferStream>(length);
+	if (!bufferStream || !bufferStream->getBuffer()) {
+		return nullptr;
+	}
+	memcpy(bufferStream->buffer, start, length);
+	return bufferStream;
+}
+
+void BufferStream::attach(std::shared_ptr<BlockStorage> newStorage, uint8_t * data) {
+	portENTER_CRITICAL(&blockStorageLock);
+	storage = std::move(newStorage);
+	buffer = data;
+	prevView = nullptr;
+	nextView = storage->views;
+	if (nextView) {
+		nextView->prevView = this;
+	}
+	storage->views = this;
+	portEXIT_CRITICAL(&blockStorageLock);
+}
+
+void BufferStream::detach() {
+	if (!storage) {
+		return;
+	}
+	portENTER_CRITICAL(&blockStorageLock);
+	if (prevView) {
+		prevView->nextView = nextView;
+	} else {
+		storage->views = nextView;
+	}
+	if (nextView) {
+		nextView->prevView = prevView;
+	}
+	prevView = nullptr;
+	nextView = nullptr;
+	portEXIT_CRITICAL(&blockStorageLock);
+	storage.reset();
+}
+
+// Check whether any other block using our storage covers part of the given range
+//
+bool BufferStream::overlaps(const uint8_t * start, uint32_t length, bool pinnedOnly) const {
+	if (!storage) {
+		return false;
+	}
+	bool found = false;
+	portENTER_CRITICAL(&blockStorageLock);
+	for (auto view = storage->views; view && !found; view = view->nextView) {
+		if ((view == this && !pinnedOnly) || (pinnedOnly && !view->pinned)) {
+			continue;
+		}
+		found = view->buffer < start + length && start < view->buffer + view->bufferLength;
+	}
+	portEXIT_CRITICAL(&blockStorageLock);
+	return found;
+}
+
+// Give this block a private copy of its data, if any other block can see it
+// Returns false if the copy couldn't be allocated
+//
+bool BufferStream::copyOnWrite() {
+	if (!storage) {
+		return false;
+	}
+	if (!overlaps(buffer, bufferLength, false)) {
+		return true;
+	}
+	auto newStorage = make_shared_psram<BlockStorage>(bufferLength);
+	if (!newStorage || !newStorage->data) {
+		debug_log("BufferStream::copyOnWrite: failed to allocate %u bytes\n\r", bufferLength);
+		return false;
+	}
+	auto data = newStorage->data.get();
+	memcpy(data, buffer, bufferLength);
+	detach();
+	attach(std::move(newStorage), data);
+	return true;
 }
 
 int BufferStream::available() {
@@ -89,11 +268,11 @@ size_t BufferStream::write(uint8_t b) {
 	return 0;
 }
 
-bool BufferStream::writeBuffer(uint8_t * data, uint32_t length, uint32_t offset = 0) {
+bool BufferStream::writeBuffer(const uint8_t * data, uint32_t length, uint32_t offset = 0) {
 	// TODO consider return type - we could support writing to buffer limit,
 	// and returning how many bytes were written
-	if (length + offset <= bufferLength) {
-		memcpy(buffer.get() + offset, data, length);
+	if (length + offset <= bufferLength && makeWritable()) {
+		memcpy(buffer + offset, data, length);
 		return true;
 	} else {
 		debug_log("BufferStream::writeBuffer: buffer overflow\n\r");
@@ -102,7 +281,7 @@ bool BufferStream::writeBuffer(uint8_t * data, uint32_t length, uint32_t offset
 }
 
 void BufferStream::writeBufferByte(uint8_t data, uint32_t offset = 0) {
-	if (offset < bufferLength) {
+	if (offset < bufferLength && makeWritable()) {
 		buffer[offset] = data;
 	}
 }
@@ -111,7 +290,7 @@ void BufferStream::writeBufferByte(uint8_t data, uint32_t offset = 0) {
 // accepts an offset and a value to increment by
 // returns true if value overflowed
 bool BufferStream::incrementBufferByte(uint32_t offset = 0, int8_t by = 1) {
-	if (offset < bufferLength) {
+	if (offset < bufferLength && makeWritable()) {
 		auto oldValue = buffer[offset];
 		buffer[offset] += by;
 
@@ -143,7 +322,7 @@ class WritableBufferStream : public BufferStream {
 };
 
 size_t WritableBufferStream::write(uint8_t b) {
-	if (bufferWritePosition < bufferLength) {
+	if (bufferWritePosition < bufferLength && makeWritable()) {
 		buffer[bufferWritePosition++] = b;
 		return 1;
 	}
@@ -0,0 +1,156 @@
+#ifndef BUFFER_VECTOR_H
+#define BUFFER_VECTOR_H
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "buffer_stream.h"
+#include "types.h"
+
+// The list of blocks that make up a buffer
+//
+// Alongside the blocks we keep a running total of block sizes.  Block sizes never
+// change once a block is created, so the totals only need updating when blocks are
+// added, removed or reordered, all of which goes through the methods below.
+// This makes the total size of a buffer available without walking its blocks,
+// and lets a byte offset be mapped to its block with a binary search.
+//
+// Streams running a buffer's commands read its blocks by reference rather than copying them.
+// They register as readers, and before the blocks change each reader is asked to take its own
+// copy, so a running buffer keeps running the blocks it started with.
+//
+class BufferVector {
+	public:
+		using BlockVector = std::vector<std::shared_ptr<BufferStream>, psram_allocator<std::shared_ptr<BufferStream>>>;
+		using const_iterator = BlockVector::const_iterator;
+
+		class Reader {
+			public:
+				// Called before the blocks change, after which the reader is no longer registered
+				virtual void blocksChanging(const BufferVector &blocks) = 0;
+			private:
+				friend class BufferVector;
+				Reader * nextReader = nullptr;
+		};
+
+		BufferVector() {}
+		BufferVector(const BufferVector &other) : blocks(other.blocks), blockEnds(other.blockEnds) {}
+		BufferVector &operator=(const BufferVector &other) {
+			if (this != &other) {
+				releaseReaders();
+				blocks = other.blocks;
+				blockEnds = other.blockEnds;
+			}
+			return *this;
+		}
+		~BufferVector() {
+			releaseReaders();
+		}
+
+		void addReader(Reader * reader) const {
+			reader->nextReader = readers;
+			readers = reader;
+		}
+
+		void removeReader(Reader * reader) const {
+			for (auto link = &readers; *link; link = &(*link)->nextReader) {
+				if (*link == reader) {
+					*link = reader->nextReader;
+					reader->nextReader = nullptr;
+					return;
+				}
+			}
+		}
+
+		inline size_t size() const { return blocks.size(); }
+		inline bool empty() const { return blocks.empty(); }
+		inline const std::shared_ptr<BufferStream> &operator[](size_t index) const { return blocks[index]; }
+		inline const std::shared_ptr<BufferStream> &front() const { return blocks.front(); }
+		inline const std::shared_ptr<BufferStream> &back() const { return blocks.back(); }
+		inline const_iterator begin() const { return blocks.begin(); }
+		inline const_iterator end() const { return blocks.end(); }
+
+		void push_back(std::shared_ptr<BufferStream> block) {
+			releaseReaders();
+			blocks.push_back(std::move(block));
+			updateIndex(blocks.size() - 1);
+		}
+
+		template <class InputIt>
+		void assign(InputIt first, InputIt last) {
+			releaseReaders();
+			blocks.assign(first, last);
+			updateIndex(0);
+		}
+
+		template <class InputIt>
+		void insert(const_iterator position, InputIt first, InputIt last) {
+			auto index = position - blocks.begin();
+			releaseReaders();
+			blocks.insert(position, first, last);
+			updateIndex(index);
+		}
+
+		void clear() {
+			releaseReaders();
+			blocks.clear();
+			blockEnds.clear();
+		}
+
+		void swap(BufferVector &other) {
+			releaseReaders();
+			other.releaseReaders();
+			blocks.swap(other.blocks);
+			blockEnds.swap(other.blockEnds);
+		}
+
+		void reverse() {
+			releaseReaders();
+			std::reverse(blocks.begin(), blocks.end());
+			updateIndex(0);
+		}
+
+		// Total size of all blocks in bytes
+		inline uint32_t totalSize() const {
+			return blockEnds.empty() ? 0 : blockEnds.back();
+		}
+
+		// Offset of the start of a block from the start of the buffer
+		// an index of size() gives the total size
+		inline uint32_t blockStart(size_t index) const {
+			return index == 0 ? 0 : blockEnds[index - 1];
+		}
+
+		// Index of the block containing the given offset from the start of the buffer
+		// Returns size() if the offset is past the end of the buffer
+		inline size_t findBlock(uint32_t offset) const {
+			return std::upper_bound(blockEnds.begin(), blockEnds.end(), offset) - blockEnds.begin();
+		}
+
+	private:
+		BlockVector blocks;
+		std::vector<uint32_t, psram_allocator<uint32_t>> blockEnds;	// Offset of the end of each block
+		mutable Reader * readers = nullptr;		// Streams reading the blocks by reference
+
+		// Let every reader take its own copy of the blocks before they change
+		void releaseReaders() {
+			while (readers) {
+				auto reader = readers;
+				readers = reader->nextReader;
+				reader->nextReader = nullptr;
+				reader->blocksChanging(*this);
+			}
+		}
+
+		void updateIndex(size_t from) {
+			blockEnds.resize(blocks.size());
+			auto end = blockStart(from);
+			for (auto i = from; i < blocks.size(); i++) {
+				end += blocks[i] ? blocks[i]->size() : 0;
+				blockEnds[i] = end;
+			}
+		}
+};
+
+#endif // BUFFER_VECTOR_H
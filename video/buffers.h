@@ -8,11 +8,110 @@
 
 #include "agon.h"
 #include "buffer_stream.h"
+#include "buffer_vector.h"
 #include "span.h"
 #include "types.h"
 
-using BufferVector = std::vector<std::shared_ptr<BufferStream>, psram_allocator<std::shared_ptr<BufferStream>>>;
-std::unordered_map<uint16_t, BufferVector, std::hash<uint16_t>, std::equal_to<uint16_t>, psram_allocator<std::pair<const uint16_t, BufferVector>>> buffers;
+// Table of buffers, indexed directly by buffer ID
+//
+// The 65536 possible IDs are split into 256 pages of 256 entries.  A page is allocated
+// (in PSRAM where available) the first time an ID within it is used, so lookups need
+// no hashing - just two array indexes.  Pages are never released, which keeps entry
+// addresses stable for the lifetime of the VDP.
+//
+// The interface mirrors the subset of std::unordered_map that buffer code uses,
+// with find() returning an entry pointer and end() returning nullptr.
+//
+class BufferTable {
+	public:
+		struct Entry {
+			uint16_t		first;
+			bool			present;
+			bool			compressed;		// Contents are held in the Agon compressed format
+			BufferVector	second;
+		};
+		using iterator = Entry *;
+
+		BufferTable() : pages(), count(0) {}
+
+		inline iterator find(uint16_t bufferId) const {
+			auto page = pages[bufferId >> 8];
+			if (page == nullptr) {
+				return end();
+			}
+			auto entry = &page[bufferId & 0xFF];
+			return entry->present ? entry : end();
+		}
+
+		inline iterator end() const {
+			return nullptr;
+		}
+
+		// Returns the blocks for the given buffer, creating an empty buffer if needed
+		// If the buffer's page can't be allocated, returns an empty stand-in vector that isn't
+		// part of the table, so anything added to it is dropped on the next failure
+		BufferVector &operator[](uint16_t bufferId) {
+			auto &page = pages[bufferId >> 8];
+			if (page == nullptr) {
+				page = allocatePage(bufferId & 0xFF00);
+				if (page == nullptr) {
+					BufferVector().swap(unavailable);
+					return unavailable;
+				}
+			}
+			auto &entry = page[bufferId & 0xFF];
+			if (!entry.present) {
+				entry.present = true;
+				count++;
+			}
+			return entry.second;
+		}
+
+		void erase(iterator entry) {
+			if (entry == end() || !entry->present) {
+				return;
+			}
+			BufferVector().swap(entry->second);
+			entry->present = false;
+			entry->compressed = false;
+			count--;
+		}
+
+		void clear() {
+			for (auto page : pages) {
+				if (page == nullptr) {
+					continue;
+				}
+				for (auto i = 0; i < 256; i++) {
+					erase(&page[i]);
+				}
+			}
+		}
+
+		inline size_t size() const {
+			return count;
+		}
+
+	private:
+		Entry *		pages[256];
+		size_t		count;
+		BufferVector	unavailable;
+
+		static Entry * allocatePage(uint16_t baseId) {
+			psram_allocator<Entry> allocator;
+			auto page = allocator.allocate(256);
+			if (page == nullptr) {
+				debug_log("BufferTable: failed to allocate page for buffers %d to %d\n\r", baseId, baseId + 255);
+				return nullptr;
+			}
+			for (auto i = 0; i < 256; i++) {
+				allocator.construct(&page[i], Entry { (uint16_t)(baseId + i), false, false, {} });
+			}
+			return page;
+		}
+};
+
+BufferTable buffers;
 
 struct AdvancedOffset {
 	uint32_t blockOffset = 0;
@@ -108,17 +207,23 @@ std::shared_ptr<BufferStream> consolidateBuffers(const BufferVector &streams) {
 	if (streams.size() == 1) {
 		return streams.front();
 	}
-	// work out total length of buffer
+	// work out total length of buffer, and whether the blocks are already laid out in order
 	uint32_t length = 0;
-	for (auto &block : streams) {
-		length += block->size();
+	bool contiguous = !streams.empty();
+	for (size_t i = 0; i < streams.size(); i++) {
+		contiguous = contiguous && (i == 0 || streams[i]->follows(*streams[i - 1]));
+		length += streams[i]->size();
+	}
+	if (contiguous) {
+		// blocks are consecutive ranges of one storage (such as a split buffer) so share it
+		return BufferStream::share(streams.front(), 0, length);
 	}
 	auto bufferStream = make_shared_psram<BufferStream>(length);
 	if (!bufferStream || !bufferStream->getBuffer()) {
 		// buffer couldn't be created
 		return nullptr;
 	}
-	auto destination = bufferStream->getBuffer();
+	auto destination = bufferStream->getWritableBuffer();
 	for (auto &block : streams) {
 		auto bufferLength = block->size();
 		memcpy(destination, block->getBuffer(), bufferLength);
@@ -128,11 +233,12 @@ std::shared_ptr<BufferStream> consolidateBuffers(const BufferVector &streams) {
 }
 
 // split a buffer into multiple blocks/chunks
+// chunks share the data of the source buffer until they are written to
 BufferVector splitBuffer(std::shared_ptr<BufferStream> buffer, uint16_t length) {
 	BufferVector chunks;
 	auto totalLength = buffer->size();
 	auto remaining = totalLength;
-	auto sourceData = buffer->getBuffer();
+	uint32_t offset = 0;
 
 	// chop up source data by length, storing into new buffers
 	// looping the buffer list until we have no data left
@@ -141,15 +247,14 @@ BufferVector splitBuffer(std::shared_ptr<BufferStream> buffer, uint16_t length)
 		if (remaining < bufferLength) {
 			bufferLength = remaining;
 		}
-		auto chunk = make_shared_psram<BufferStream>(bufferLength);
+		auto chunk = BufferStream::share(buffer, offset, bufferLength);
 		if (!chunk || !chunk->getBuffer()) {
 			// buffer couldn't be created, so return an empty vector
 			chunks.clear();
 			break;
 		}
-		memcpy(chunk->getBuffer(), sourceData, bufferLength);
 		chunks.push_back(std::move(chunk));
-		sourceData += bufferLength;
+		offset += bufferLength;
 		remaining -= bufferLength;
 	}
 	return chunks;
@@ -192,7 +297,13 @@ void extractFormatInfo(uint8_t format, bool &isFixed, bool &is16Bit, int8_t &shi
 
 // Get the longest contiguous span at the given buffer offset. Updates the offset to the correct block index.
 // accepts a size to dictate the minimum span size, and will align offset if block didn't contain the required size of data
-tcb::span<uint8_t> getBufferSpan(const BufferVector &buffer, AdvancedOffset &offset, uint8_t size = 1) {
+tcb::span<const uint8_t> getBufferSpan(const BufferVector &buffer, AdvancedOffset &offset, uint8_t size = 1) {
+	if (offset.blockIndex < buffer.size() && offset.blockOffset >= buffer[offset.blockIndex]->size()) {
+		// offset is beyond the current block, so skip straight to the block that contains it
+		auto position = buffer.blockStart(offset.blockIndex) + offset.blockOffset;
+		offset.blockIndex = buffer.findBlock(position);
+		offset.blockOffset = position - buffer.blockStart(offset.blockIndex);
+	}
 	while (offset.blockIndex < buffer.size()) {
 		// check for available bytes in the current block
 		auto &block = buffer[offset.blockIndex];
@@ -208,7 +319,20 @@ tcb::span<uint8_t> getBufferSpan(const BufferVector &buffer, AdvancedOffset &off
 	return {};
 }
 
-tcb::span<uint8_t> getBufferSpan(const uint16_t bufferId, AdvancedOffset &offset, uint8_t size = 1) {
+// As getBufferSpan, but for writing to - the block the span is in gets its own copy of any shared data
+tcb::span<uint8_t> getWritableBufferSpan(const BufferVector &buffer, AdvancedOffset &offset, uint8_t size = 1) {
+	auto span = getBufferSpan(buffer, offset, size);
+	if (span.empty()) {
+		return {};
+	}
+	auto data = buffer[offset.blockIndex]->getWritableBuffer();
+	if (!data) {
+		return {};
+	}
+	return { data + offset.blockOffset, span.size() };
+}
+
+tcb::span<const uint8_t> getBufferSpan(const uint16_t bufferId, AdvancedOffset &offset, uint8_t size = 1) {
 	auto bufferIter = buffers.find(bufferId);
 	if (bufferIter == buffers.end()) {	// buffer not found
 		return {};
@@ -216,6 +340,26 @@ tcb::span<uint8_t> getBufferSpan(const uint16_t bufferId, AdvancedOffset &offset
 	return getBufferSpan(bufferIter->second, offset, size);
 }
 
+// Call fn(data, length) for each contiguous span of a range of bytes in a buffer, in order
+// Returns false if the range runs past the end of the buffer
+//
+template <typename F>
+bool forEachBufferSpan(const BufferVector &buffer, uint32_t start, uint32_t length, F &&fn) {
+	if (start + length > buffer.totalSize()) {
+		return false;
+	}
+	auto index = buffer.findBlock(start);
+	auto offset = start - buffer.blockStart(index);
+	while (length > 0) {
+		auto &block = buffer[index++];
+		auto spanLength = std::min<uint32_t>(length, block->size() - offset);
+		fn(block->getBuffer() + offset, spanLength);
+		length -= spanLength;
+		offset = 0;
+	}
+	return true;
+}
+
 // Utility call to read a byte from a buffer at the given offset
 int16_t getBufferByte(const BufferVector &buffer, AdvancedOffset &offset, bool iterate = false) {
 	auto bufferSpan = getBufferSpan(buffer, offset);
@@ -254,7 +398,7 @@ float readBufferFloat(uint32_t sourceBufferId, AdvancedOffset &offset, bool is16
 
 // Utility call to set a byte in a buffer at the given offset
 bool setBufferByte(uint8_t value, const BufferVector &buffer, AdvancedOffset &offset, bool iterate = false) {
-	auto bufferSpan = getBufferSpan(buffer, offset);
+	auto bufferSpan = getWritableBufferSpan(buffer, offset);
 	if (bufferSpan.empty()) {
 		// offset not found in buffer
 		return false;
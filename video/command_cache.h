@@ -0,0 +1,154 @@
+#ifndef COMMAND_CACHE_H
+#define COMMAND_CACHE_H
+
+// Pre-decoded buffered commands for buffers that are run repeatedly
+//
+// With TEST_FLAG_FAST_DISPATCH set, running a called or jumped-to buffer records where each
+// VDU 23, 0, &A0, bufferId; command header in it starts, along with its decoded bufferId and
+// command.  Later runs of the buffer dispatch those commands straight from the list, skipping
+// the header bytes instead of reading them one at a time through vdu(), vdu_sys() and
+// vdu_sys_video().  Commands run in order, so each lookup is normally a single comparison.
+//
+// A buffer's list is dropped when its blocks change, as the list registers as a reader of
+// the buffer's blocks.  Each entry also keeps the write count of the block it was decoded
+// from, so it is decoded again after that block has been written to, even through another
+// buffer sharing the block.  Pinned blocks (used by bitmaps and fonts) can be written to
+// without the block knowing, so commands in them are never recorded.
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer_stream.h"
+#include "buffer_vector.h"
+#include "buffers.h"
+#include "types.h"
+
+#define COMMAND_CACHE_MAX_COMMANDS	1024	// Most commands recorded for each buffer
+
+struct CachedCommand {
+	uint32_t	blockIndex;
+	uint32_t	offset;			// Position of the header in its block
+	uint32_t	writeCount;		// Write count of the block when the header was decoded
+	uint16_t	bufferId;
+	uint8_t		command;
+};
+
+class CommandList : private BufferVector::Reader {
+	public:
+		CommandList(const BufferVector &blocks) : blocks(&blocks) {
+			blocks.addReader(this);
+		}
+		~CommandList() {
+			if (blocks) {
+				blocks->removeReader(this);
+			}
+		}
+		CommandList(const CommandList &) = delete;
+		CommandList &operator=(const CommandList &) = delete;
+
+		// The blocks the list was decoded from, or nullptr once they have changed
+		inline const BufferVector * source() const {
+			return blocks;
+		}
+		const CachedCommand * find(uint32_t blockIndex, uint32_t offset);
+		void record(const CachedCommand &command);
+
+	private:
+		const BufferVector * blocks;
+		std::vector<CachedCommand, psram_allocator<CachedCommand>> commands;
+		size_t next = 0;		// Index of the command expected to run next
+
+		size_t position(uint32_t blockIndex, uint32_t offset) const;
+		void blocksChanging(const BufferVector &changing);
+};
+
+// Find the command recorded at the given position
+// Returns nullptr if no command was recorded there
+//
+const CachedCommand * CommandList::find(uint32_t blockIndex, uint32_t offset) {
+	auto index = next;
+	if (index >= commands.size() || commands[index].blockIndex != blockIndex || commands[index].offset != offset) {
+		// not the command after the last one found, so we've jumped or are between commands
+		index = position(blockIndex, offset);
+		if (index == commands.size() || commands[index].blockIndex != blockIndex || commands[index].offset != offset) {
+			next = index;
+			return nullptr;
+		}
+	}
+	next = index + 1;
+	return &commands[index];
+}
+
+// Record a decoded command, replacing any already recorded at the same position
+//
+void CommandList::record(const CachedCommand &command) {
+	auto index = position(command.blockIndex, command.offset);
+	if (index < commands.size() && commands[index].blockIndex == command.blockIndex && commands[index].offset == command.offset) {
+		commands[index] = command;
+	} else if (commands.size() < COMMAND_CACHE_MAX_COMMANDS) {
+		commands.insert(commands.begin() + index, command);
+	} else {
+		return;
+	}
+	next = index + 1;
+}
+
+// Index of the first command at or after the given position
+//
+size_t CommandList::position(uint32_t blockIndex, uint32_t offset) const {
+	return std::lower_bound(commands.begin(), commands.end(), std::make_pair(blockIndex, offset),
+		[](const CachedCommand &command, const std::pair<uint32_t, uint32_t> &position) {
+			return command.blockIndex < position.first ||
+				(command.blockIndex == position.first && command.offset < position.second);
+		}) - commands.begin();
+}
+
+void CommandList::blocksChanging(const BufferVector &changing) {
+	blocks = nullptr;
+	decltype(commands)().swap(commands);
+	next = 0;
+}
+
+class CommandCache {
+	public:
+		std::shared_ptr<CommandList> get(uint16_t bufferId, const BufferVector &blocks);
+		void invalidate(uint16_t bufferId);
+		void clear();
+
+	private:
+		std::unordered_map<uint16_t, std::shared_ptr<CommandList>,
+			std::hash<uint16_t>, std::equal_to<uint16_t>,
+			psram_allocator<std::pair<const uint16_t, std::shared_ptr<CommandList>>>> lists;
+};
+
+CommandCache commandCache;
+
+// Get the command list for a buffer that is running from the given blocks
+// Returns nullptr if the blocks aren't the buffer's own, such as a decompressed copy,
+// or the blocks a running buffer had before it changed
+//
+std::shared_ptr<CommandList> CommandCache::get(uint16_t bufferId, const BufferVector &blocks) {
+	auto bufferIter = buffers.find(bufferId);
+	if (bufferIter == buffers.end() || &bufferIter->second != &blocks) {
+		return nullptr;
+	}
+	auto &list = lists[bufferId];
+	if (!list || list->source() != &blocks) {
+		list = make_shared_psram<CommandList>(blocks);
+	}
+	return list;
+}
+
+// Drop the command list of a buffer that has been removed
+//
+void CommandCache::invalidate(uint16_t bufferId) {
+	lists.erase(bufferId);
+}
+
+void CommandCache::clear() {
+	lists.clear();
+}
+
+#endif // COMMAND_CACHE_H
@@ -25,9 +25,25 @@ extern void debug_log(const char * format, ...);		// Debug log function
 #define COMPRESSION_WINDOW_SIZE 256     // power of 2
 #define COMPRESSION_STRING_SIZE 16      // power of 2
 #define COMPRESSION_TYPE_TURBO  'T'     // TurboVega-style compression
+#define COMPRESSION_TYPE_LZ     'L'     // Byte-aligned LZ compression, see below
+#define COMPRESSION_TYPE_PARALLEL 'P'   // TurboVega-style compression in independent chunks, see below
 #define TEMP_BUFFER_SIZE        256
 
-#define COMPRESSION_OUTPUT_CHUNK_SIZE	1024 // used to extend temporary buffer
+#define COMPRESSION_OUTPUT_CHUNK_SIZE	1024 // size of the first compressed output block
+#define COMPRESSION_OUTPUT_MAX_BLOCK	16384 // output blocks double in size up to this
+
+// Match finding
+//
+// Every match is at least 4 bytes long, so the compressor keeps an index of the
+// window positions by a hash of the 4 bytes starting at each position.  Each hash
+// has a bitmap of the positions, so the candidates for a match can be checked in
+// ascending order, giving the same (lowest) window index that a full scan of the
+// window would find, and so the same compressed output.
+//
+#define COMPRESSION_HASH_BITS   6
+#define COMPRESSION_HASH_SIZE   (1 << COMPRESSION_HASH_BITS)
+#define COMPRESSION_MASK_WORDS  (COMPRESSION_WINDOW_SIZE / 32)
+#define COMPRESSION_MIN_MATCH   4
 
 #pragma pack(push, 1)
 typedef struct {
@@ -56,6 +72,8 @@ typedef struct {
     uint8_t             temp_buffer[TEMP_BUFFER_SIZE];
     uint8_t             out_byte;
     uint8_t             out_bits;
+    uint8_t             window_hash[COMPRESSION_WINDOW_SIZE];                       // hash of the 4 bytes at each window position
+    uint32_t            hash_positions[COMPRESSION_HASH_SIZE][COMPRESSION_MASK_WORDS];  // window positions for each hash
 } CompressionData;
 
 typedef struct {
@@ -68,7 +86,7 @@ typedef struct {
     uint32_t            orig_size;
     uint8_t             window_data[COMPRESSION_WINDOW_SIZE];
     uint8_t             temp_buffer[TEMP_BUFFER_SIZE];
-    uint16_t            code;
+    uint32_t            code;
     uint8_t             code_bits;
 } DecompressionData;
 
@@ -94,28 +112,6 @@ void agon_write_compressed_byte(CompressionData* cd, uint8_t comp_byte) {
     }
 }
 
-// Write compressed output to a temporary buffer
-//
-static void local_write_compressed_byte(void* p_cd, uint8_t comp_byte) {
-	CompressionData* cd = (CompressionData*) p_cd;
-    uint8_t** pp_temp = (uint8_t**) cd->context;
-	uint8_t* p_temp = *pp_temp;
-	p_temp[cd->output_count++] = comp_byte;
-	if (!(cd->output_count & (COMPRESSION_OUTPUT_CHUNK_SIZE-1))) {
-		// extend the temporary buffer to make room for more output
-		auto new_size = cd->output_count + COMPRESSION_OUTPUT_CHUNK_SIZE;
-		uint8_t* p_temp2 = (uint8_t*) ps_malloc(new_size);
-		if (p_temp2) {
-			memcpy(p_temp2, p_temp, cd->output_count);
-			*pp_temp = p_temp2; // use new buffer pointer now
-		} else {
-			debug_log("bufferCompress: cannot allocate temporary buffer of %d bytes\n\r", new_size);
-			*pp_temp = NULL; // indicate failure
-		}
-		heap_caps_free(p_temp);
-	}
-}
-
 // Write decompressed output to a temporary buffer
 //
 static bool local_write_decompressed_byte(void* p_dd, uint8_t orig_data) {
@@ -129,6 +125,48 @@ static bool local_write_decompressed_byte(void* p_dd, uint8_t orig_data) {
     return true;
 }
 
+static inline uint8_t agon_compression_hash(const uint8_t* data) {
+    uint32_t value = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    return (uint8_t) ((value * 2654435761u) >> (32 - COMPRESSION_HASH_BITS));
+}
+
+// Add an original byte to the window, updating the hashes of the positions it is part of
+//
+void agon_add_window_byte(CompressionData* cd, uint8_t orig_byte) {
+    uint32_t index = cd->window_write_index;
+    uint32_t old_size = cd->window_size;
+    cd->window_data[index] = orig_byte;
+    cd->window_write_index = (index + 1) & (COMPRESSION_WINDOW_SIZE - 1);
+    if (cd->window_size < COMPRESSION_WINDOW_SIZE) {
+        (cd->window_size)++;
+    }
+
+    // A match can't run past the end of the window data, so only positions
+    // with 4 bytes of data after them are indexed
+    uint32_t first = index >= COMPRESSION_MIN_MATCH - 1 ? index - (COMPRESSION_MIN_MATCH - 1) : 0;
+    uint32_t last = index <= COMPRESSION_WINDOW_SIZE - COMPRESSION_MIN_MATCH ? index : COMPRESSION_WINDOW_SIZE - COMPRESSION_MIN_MATCH;
+    for (uint32_t position = first; position <= last; position++) {
+        uint32_t word = position >> 5;
+        uint32_t bit = 1u << (position & 31);
+        if (position + COMPRESSION_MIN_MATCH <= old_size) {
+            cd->hash_positions[cd->window_hash[position]][word] &= ~bit;
+        }
+        if (position + COMPRESSION_MIN_MATCH <= cd->window_size) {
+            uint8_t hash = agon_compression_hash(&cd->window_data[position]);
+            cd->window_hash[position] = hash;
+            cd->hash_positions[hash][word] |= bit;
+        }
+    }
+}
+
+// Write a code for a string of bytes from the window
+//
+void agon_write_compressed_string(CompressionData* cd, uint8_t command, uint8_t start) {
+    agon_write_compressed_bit(cd, command >> 1);
+    agon_write_compressed_bit(cd, command & 1);
+    agon_write_compressed_byte(cd, start); // Output window index
+}
+
 void agon_compress_byte(CompressionData* cd, uint8_t orig_byte) {
     // Add the new original byte to the string
     cd->string_data[cd->string_write_index++] = orig_byte;
@@ -140,94 +178,64 @@ void agon_compress_byte(CompressionData* cd, uint8_t orig_byte) {
     }
 
     if (cd->string_size >= 16) {
-        if (cd->window_size >= 16) {
-            // Determine whether the full string of 16 is in the window
-            for (uint32_t start = 0; start <= cd->window_size - 16; start++) {
-                uint32_t wi = start;
-                uint32_t si = cd->string_read_index;
-                uint8_t match = 1;
-                for (uint8_t i = 0; i < 16; i++) {
-                    if (cd->window_data[wi++] != cd->string_data[si++]) {
-                        match = 0;
-                        break;
-                    }
-                    wi &= (COMPRESSION_WINDOW_SIZE - 1);
-                    si &= (COMPRESSION_STRING_SIZE - 1);
+        // Find the first window positions holding the string of 16, or failing that 8 or 4 bytes of it
+        uint8_t string[COMPRESSION_STRING_SIZE];
+        for (uint8_t i = 0; i < COMPRESSION_STRING_SIZE; i++) {
+            string[i] = cd->string_data[(cd->string_read_index + i) & (COMPRESSION_STRING_SIZE - 1)];
+        }
+        int32_t start8 = -1;
+        int32_t start4 = -1;
+        const uint32_t* positions = cd->hash_positions[agon_compression_hash(string)];
+        for (uint32_t word = 0; word < COMPRESSION_MASK_WORDS; word++) {
+            uint32_t mask = positions[word];
+            while (mask) {
+                uint32_t start = (word << 5) + __builtin_ctz(mask);
+                mask &= mask - 1;
+                uint32_t limit = cd->window_size - start;
+                if (limit > COMPRESSION_STRING_SIZE) {
+                    limit = COMPRESSION_STRING_SIZE;
                 }
-                if (match) {
-                    agon_write_compressed_bit(cd, 1); // Output first '1' of '11iiiiiiii'.
-                    agon_write_compressed_bit(cd, 1); // Output second '1' of '11iiiiiiii'.
-                    agon_write_compressed_byte(cd, (uint8_t) (start)); // Output window index
+                const uint8_t* window = &cd->window_data[start];
+                uint32_t length = 0;
+                while (length < limit && window[length] == string[length]) {
+                    length++;
+                }
+                if (length >= 16) {
+                    agon_write_compressed_string(cd, 3, (uint8_t) start); // '11iiiiiiii'
                     cd->string_size = 0;
                     return;
                 }
-            }
-        }
-
-        if (cd->window_size >= 8) {
-            // Determine whether the partial string of 8 is in the window
-            for (uint32_t start = 0; start <= cd->window_size - 8; start++) {
-                uint32_t wi = start;
-                uint32_t si = cd->string_read_index;
-                uint8_t match = 1;
-                for (uint8_t i = 0; i < 8; i++) {
-                    if (cd->window_data[wi++] != cd->string_data[si++]) {
-                        match = 0;
-                        break;
-                    }
-                    wi &= (COMPRESSION_WINDOW_SIZE - 1);
-                    si &= (COMPRESSION_STRING_SIZE - 1);
+                if (length >= 8 && start8 < 0) {
+                    start8 = start;
                 }
-                if (match) {
-                    agon_write_compressed_bit(cd, 1); // Output '1' of '10iiiiiiii'.
-                    agon_write_compressed_bit(cd, 0); // Output '0' of '10iiiiiiii'.
-                    agon_write_compressed_byte(cd, (uint8_t) (start)); // Output window index
-                    cd->string_size -= 8;
-                    cd->string_read_index = (cd->string_read_index + 8) & (COMPRESSION_STRING_SIZE - 1);
-                    return;
+                if (length >= 4 && start4 < 0) {
+                    start4 = start;
                 }
             }
         }
-            
-        if (cd->window_size >= 4) {
-            // Determine whether the partial string of 4 is in the window
-            for (uint32_t start = 0; start <= cd->window_size - 4; start++) {
-                uint32_t wi = start;
-                uint32_t si = cd->string_read_index;
-                uint8_t match = 1;
-                for (uint8_t i = 0; i < 4; i++) {
-                    if (cd->window_data[wi++] != cd->string_data[si++]) {
-                        match = 0;
-                        break;
-                    }
-                    wi &= (COMPRESSION_WINDOW_SIZE - 1);
-                    si &= (COMPRESSION_STRING_SIZE - 1);
-                }
-                if (match) {
-                    agon_write_compressed_bit(cd, 0); // Output '0' of '01iiiiiiii'.
-                    agon_write_compressed_bit(cd, 1); // Output '1' of '01iiiiiiii'.
-                    agon_write_compressed_byte(cd, (uint8_t) (start)); // Output window index
-                    cd->string_size -= 4;
-                    cd->string_read_index = (cd->string_read_index + 4) & (COMPRESSION_STRING_SIZE - 1);
-                    return;
-                }
-            }
+
+        if (start8 >= 0) {
+            agon_write_compressed_string(cd, 2, (uint8_t) start8); // '10iiiiiiii'
+            cd->string_size -= 8;
+            cd->string_read_index = (cd->string_read_index + 8) & (COMPRESSION_STRING_SIZE - 1);
+            return;
+        }
+
+        if (start4 >= 0) {
+            agon_write_compressed_string(cd, 1, (uint8_t) start4); // '01iiiiiiii'
+            cd->string_size -= 4;
+            cd->string_read_index = (cd->string_read_index + 4) & (COMPRESSION_STRING_SIZE - 1);
+            return;
         }
 
         // Need to make room in the string for the next original byte
         uint8_t old_byte = cd->string_data[cd->string_read_index++];
-        agon_write_compressed_bit(cd, 0); // Output '0' of '00xxxxxxxx'.
-        agon_write_compressed_bit(cd, 0); // Output '0' of '00xxxxxxxx'.
-        agon_write_compressed_byte(cd, (uint8_t) (old_byte)); // Output old original byte
+        agon_write_compressed_string(cd, 0, old_byte); // '00xxxxxxxx'
         cd->string_size -= 1;
         cd->string_read_index &= (COMPRESSION_STRING_SIZE - 1);
 
         // Add the old original byte to the window
-        cd->window_data[cd->window_write_index++] = old_byte;
-        cd->window_write_index &= (COMPRESSION_WINDOW_SIZE - 1);
-        if (cd->window_size < COMPRESSION_WINDOW_SIZE) {
-            (cd->window_size)++;
-        }
+        agon_add_window_byte(cd, old_byte);
     }
 }
 
@@ -305,4 +313,266 @@ void agon_decompress_byte(DecompressionData* dd, uint8_t comp_byte) {
     }
 }
 
+// Decompress a block of compressed data straight into an output buffer of orig_size bytes
+// As agon_decompress_byte, but without a call per byte - the write function is not used
+// The compressed data can be passed in over several calls, with the same output buffer
+// Returns false if the data decompresses to more than orig_size bytes
+//
+bool agon_decompress_block(DecompressionData* dd, const uint8_t* input, uint32_t length, uint8_t* output) {
+    uint32_t code = dd->code;
+    uint32_t code_bits = dd->code_bits;
+    uint32_t output_count = dd->output_count;
+    bool ok = true;
+
+    dd->input_count += length;
+    while (length--) {
+        code = (code << 8) | *input++;
+        code_bits += 8;
+        if (code_bits < 10) {
+            continue;
+        }
+        // Interpret the incoming code
+        code_bits -= 10;
+        uint32_t command = (code >> (code_bits + 8)) & 3;
+        uint8_t value = (uint8_t) (code >> code_bits);
+        code &= (1 << code_bits) - 1;
+
+        if (command == 0) {
+            // value is copy of original byte
+            dd->window_data[dd->window_write_index++] = value;
+            dd->window_write_index &= (COMPRESSION_WINDOW_SIZE - 1);
+            if (dd->window_size < COMPRESSION_WINDOW_SIZE) {
+                (dd->window_size)++;
+            }
+            if (output_count < dd->orig_size) {
+                output[output_count++] = value;
+            } else {
+                ok = false;
+            }
+            continue;
+        }
+
+        // value is index to string of 4, 8 or 16 bytes in the window
+        uint32_t size = 2 << command;
+        if (output_count + size > dd->orig_size) {
+            debug_log("Decompression overflow\n\r");
+            size = dd->orig_size - output_count;
+            ok = false;
+        }
+        uint32_t first = COMPRESSION_WINDOW_SIZE - value;
+        if (size <= first) {
+            memcpy(output + output_count, dd->window_data + value, size);
+        } else {
+            memcpy(output + output_count, dd->window_data + value, first);
+            memcpy(output + output_count + first, dd->window_data, size - first);
+        }
+        output_count += size;
+    }
+
+    dd->code = code;
+    dd->code_bits = code_bits;
+    dd->output_count = output_count;
+    return ok;
+}
+
+// Chunked TurboVega compression
+//
+// Data is split into chunks that are compressed independently, so that the chunks
+// can be compressed and decompressed in parallel.  After the header, which has the
+// total original size, each chunk is:
+//
+//   CompressionChunkHeader     sizes of the chunk, before and after compression
+//   compressed data            TurboVega compressed data, with no header of its own
+
+#define COMPRESSION_CHUNK_SIZE  32768   // original bytes per chunk
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t    compressed_size;
+    uint32_t    orig_size;
+} CompressionChunkHeader;
+#pragma pack(pop)
+
+// Byte-aligned LZ compression
+//
+// A faster alternative format, with a 64KB window and matches of any length.
+// Everything is byte-aligned, so decoding is a loop of memcpy calls.
+// The data following the header is a series of sequences, each of:
+//
+//   token          high nibble is the literal count, low nibble is the match length - 4
+//   [count...]     if the literal count is 15, bytes to add to it, continuing while a byte is 255
+//   literals       bytes to copy to the output
+//   offset         2 bytes (little-endian) back from the current output position to copy from
+//   [length...]    if the match length nibble is 15, bytes to add to it, as for the literal count
+//
+// The last sequence ends after its literals, with no match.
+// Unlike the TurboVega format this works on a whole buffer at a time, rather than a byte at a time.
+//
+// Worst case, the output is 1 byte larger per 255 bytes of input, plus one byte.
+
+#define COMPRESSION_LZ_MIN_MATCH    4
+#define COMPRESSION_LZ_MAX_OFFSET   65535
+#define COMPRESSION_LZ_HASH_BITS    12
+
+// Maximum size of the LZ compressed data for a given input size
+//
+uint32_t agon_lz_compress_bound(uint32_t length) {
+    return length + length / 255 + 16;
+}
+
+static inline uint32_t agon_lz_read32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint8_t* agon_lz_write_length(uint8_t* output, uint32_t length) {
+    while (length >= 255) {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = (uint8_t) length;
+    return output;
+}
+
+// Compress a block of data into output, which must have room for agon_lz_compress_bound(length) bytes
+// Returns the compressed size, or 0 if the match table couldn't be allocated
+//
+uint32_t agon_lz_compress(const uint8_t* input, uint32_t length, uint8_t* output) {
+    // Most recent position of each hash of 4 bytes
+    uint32_t* table = (uint32_t*) ps_malloc(sizeof(uint32_t) << COMPRESSION_LZ_HASH_BITS);
+    if (!table) {
+        debug_log("agon_lz_compress: cannot allocate match table\n\r");
+        return 0;
+    }
+    memset(table, 0xFF, sizeof(uint32_t) << COMPRESSION_LZ_HASH_BITS);
+
+    uint8_t* out = output;
+    uint32_t anchor = 0;        // start of the literals not yet written
+    uint32_t position = 0;
+    while (position + COMPRESSION_LZ_MIN_MATCH <= length) {
+        uint32_t sequence = agon_lz_read32(input + position);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - COMPRESSION_LZ_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = position;
+        if (candidate >= position || position - candidate > COMPRESSION_LZ_MAX_OFFSET ||
+            agon_lz_read32(input + candidate) != sequence) {
+            // skip ahead faster through data that isn't matching
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+
+        uint32_t match = COMPRESSION_LZ_MIN_MATCH;
+        while (position + match < length && input[candidate + match] == input[position + match]) {
+            match++;
+        }
+
+        // write the sequence
+        uint32_t literals = position - anchor;
+        uint32_t extra = match - COMPRESSION_LZ_MIN_MATCH;
+        *out++ = ((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15);
+        if (literals >= 15) {
+            out = agon_lz_write_length(out, literals - 15);
+        }
+        memcpy(out, input + anchor, literals);
+        out += literals;
+        uint32_t offset = position - candidate;
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+        if (extra >= 15) {
+            out = agon_lz_write_length(out, extra - 15);
+        }
+
+        // index the end of the match, so runs following on from it can be found
+        position += match;
+        anchor = position;
+        if (position - 2 + COMPRESSION_LZ_MIN_MATCH <= length) {
+            uint32_t endSequence = agon_lz_read32(input + position - 2);
+            table[(endSequence * 2654435761u) >> (32 - COMPRESSION_LZ_HASH_BITS)] = position - 2;
+        }
+    }
+
+    // write the final literals
+    uint32_t literals = length - anchor;
+    *out++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        out = agon_lz_write_length(out, literals - 15);
+    }
+    memcpy(out, input + anchor, literals);
+    out += literals;
+
+    heap_caps_free(table);
+    return out - output;
+}
+
+// Decompress LZ compressed data into an output buffer of orig_size bytes
+// Returns the number of bytes written, which is short of orig_size if the data is invalid
+//
+uint32_t agon_lz_decompress(const uint8_t* input, uint32_t length, uint8_t* output, uint32_t orig_size) {
+    const uint8_t* in = input;
+    const uint8_t* in_end = input + length;
+    uint32_t out = 0;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+
+        // literals
+        uint32_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t extra;
+            do {
+                if (in >= in_end) {
+                    return out;
+                }
+                extra = *in++;
+                literals += extra;
+            } while (extra == 255);
+        }
+        if (literals > (uint32_t) (in_end - in) || literals > orig_size - out) {
+            debug_log("agon_lz_decompress: literals overflow\n\r");
+            return out;
+        }
+        memcpy(output + out, in, literals);
+        in += literals;
+        out += literals;
+        if (in >= in_end) {
+            break;      // last sequence has no match
+        }
+
+        // match
+        if (in_end - in < 2) {
+            return out;
+        }
+        uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        uint32_t match = (token & 0x0F) + COMPRESSION_LZ_MIN_MATCH;
+        if ((token & 0x0F) == 15) {
+            uint8_t extra;
+            do {
+                if (in >= in_end) {
+                    return out;
+                }
+                extra = *in++;
+                match += extra;
+            } while (extra == 255);
+        }
+        if (offset == 0 || offset > out || match > orig_size - out) {
+            debug_log("agon_lz_decompress: invalid match\n\r");
+            return out;
+        }
+        uint8_t* destination = output + out;
+        const uint8_t* source = destination - offset;
+        if (offset >= match) {
+            memcpy(destination, source, match);
+        } else {
+            // overlapping copy, which repeats the last offset bytes
+            for (uint32_t i = 0; i < match; i++) {
+                destination[i] = source[i];
+            }
+        }
+        out += match;
+    }
+    return out;
+}
+
 #endif // COMPRESSION_H
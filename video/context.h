@@ -222,6 +222,7 @@ class Context {
 		void setActiveViewport(ViewportType type);
 		bool setGraphicsViewport(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
 		bool setGraphicsViewport();
+		Rect getGraphicsViewport();
 		bool setTextViewport(uint8_t cx1, uint8_t cy1, uint8_t cx2, uint8_t cy2);
 		bool setTextViewport();
 		uint8_t getNormalisedViewportCharWidth();
@@ -81,6 +81,13 @@ bool Context::setGraphicsViewport() {
 	return true;
 }
 
+// Get graphics viewport
+// screen coordinates
+//
+Rect Context::getGraphicsViewport() {
+	return graphicsViewport;
+}
+
 // Set text viewport
 // text coordinates
 //
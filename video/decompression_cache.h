@@ -0,0 +1,284 @@
+#ifndef DECOMPRESSION_CACHE_H
+#define DECOMPRESSION_CACHE_H
+
+// Decompression of buffers held in the Agon compressed format
+//
+// A buffer can be marked as compressed with VDU 23, 0, &A0, bufferId; &42, 1
+// after which it stays compressed in PSRAM, and is only decompressed when it
+// is used in a way that needs the original data:
+//
+// - calling or jumping to the buffer runs the commands from a decompressed copy
+// - creating a sample from the buffer gives the sample a decompressed copy
+// - bitmaps and fonts are drawn straight from buffer memory, so creating one
+//   from a compressed buffer decompresses the buffer in place, and clears its mark
+//
+// Only calls and jumps gain from this.  Bitmaps, fonts and samples read their
+// data at any time for as long as they exist (fabgl draws from the pixel data
+// every frame, and the mixer reads samples as they play) so a per-use copy
+// would be held for their whole life.  Samples keep a decompressed copy
+// alongside the compressed buffer, and bitmaps and fonts replace the buffer
+// contents so only one copy is kept.
+//
+// Decompressed copies are kept in a small least-recently-used cache so a buffer
+// that is called repeatedly is only decompressed once.  Users of a cached copy
+// hold their own reference to it, so entries can be evicted at any time.
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "buffers.h"
+#include "buffer_stream.h"
+#include "buffer_vector.h"
+#include "compression.h"
+#include "parallel.h"
+#include "types.h"
+
+#define DECOMPRESSION_CACHE_SIZE	(128 * 1024)	// Bytes of decompressed data to keep
+
+// Check whether a buffer starts with a valid compression header
+//
+bool isCompressedBuffer(const BufferVector &source) {
+	if (source.empty() || source[0]->size() < sizeof(CompressionFileHeader)) {
+		return false;
+	}
+	auto p_hdr = (const CompressionFileHeader*) source[0]->getBuffer();
+	return p_hdr->marker[0] == 'C' &&
+		p_hdr->marker[1] == 'm' &&
+		p_hdr->marker[2] == 'p' &&
+		(p_hdr->type == COMPRESSION_TYPE_TURBO || p_hdr->type == COMPRESSION_TYPE_LZ ||
+		p_hdr->type == COMPRESSION_TYPE_PARALLEL);
+}
+
+// Decompress chunked data into output, sharing the chunks between both cores
+// Returns the number of bytes decompressed
+//
+uint32_t decompressChunks(const BufferVector &source, uint8_t * output, uint32_t orig_size) {
+	struct Chunk {
+		uint32_t	start;			// offset of the compressed data in the source
+		uint32_t	compressedSize;
+		uint32_t	outputOffset;
+		uint32_t	origSize;
+		uint32_t	outputCount;
+	};
+	std::vector<Chunk, psram_allocator<Chunk>> chunks;
+
+	// find the chunks
+	uint32_t position = sizeof(CompressionFileHeader);
+	uint32_t outputOffset = 0;
+	auto total = source.totalSize();
+	while (position + sizeof(CompressionChunkHeader) <= total) {
+		CompressionChunkHeader chunkHeader;
+		auto destination = (uint8_t *)&chunkHeader;
+		forEachBufferSpan(source, position, sizeof(chunkHeader), [&](const uint8_t * data, uint32_t length) {
+			memcpy(destination, data, length);
+			destination += length;
+		});
+		position += sizeof(chunkHeader);
+		if (chunkHeader.compressed_size > total - position || chunkHeader.orig_size > orig_size - outputOffset) {
+			debug_log("decompressChunks: chunk %d is invalid\n\r", chunks.size());
+			break;
+		}
+		chunks.push_back({ position, chunkHeader.compressed_size, outputOffset, chunkHeader.orig_size, 0 });
+		position += chunkHeader.compressed_size;
+		outputOffset += chunkHeader.orig_size;
+	}
+
+	runOnBothCores(chunks.size(), [&](uint32_t index) {
+		auto &chunk = chunks[index];
+		DecompressionData dd;
+		agon_init_decompression(&dd, nullptr, nullptr, chunk.origSize);
+		forEachBufferSpan(source, chunk.start, chunk.compressedSize, [&](const uint8_t * data, uint32_t length) {
+			agon_decompress_block(&dd, data, length, output + chunk.outputOffset);
+		});
+		chunk.outputCount = dd.output_count;
+	});
+
+	uint32_t output_count = 0;
+	for (auto &chunk : chunks) {
+		output_count += chunk.outputCount;
+	}
+	return output_count;
+}
+
+// Decompress the blocks of a buffer into a single new block
+// Returns nullptr if the buffer isn't compressed data, or the block couldn't be allocated
+//
+std::shared_ptr<BufferStream> decompressBuffer(const BufferVector &source) {
+	if (!isCompressedBuffer(source)) {
+		debug_log("decompressBuffer: header is invalid\n\r");
+		return nullptr;
+	}
+	auto orig_size = ((const CompressionFileHeader*) source[0]->getBuffer())->orig_size;
+
+	// create output buffer
+	auto bufferStream = make_shared_psram<BufferStream>(orig_size);
+	if (!bufferStream || !bufferStream->getBuffer()) {
+		debug_log("decompressBuffer: failed to create buffer of %u bytes\n\r", orig_size);
+		return nullptr;
+	}
+
+	// decompress straight into the output block
+	auto buffer = bufferStream->getWritableBuffer();
+	uint32_t output_count = 0;
+	uint32_t skip_hdr = sizeof(CompressionFileHeader);
+	auto type = ((const CompressionFileHeader*) source[0]->getBuffer())->type;
+	if (type == COMPRESSION_TYPE_PARALLEL) {
+		output_count = decompressChunks(source, buffer, orig_size);
+	} else if (type == COMPRESSION_TYPE_LZ) {
+		// LZ data is decompressed in one go, so needs to be contiguous
+		auto block = consolidateBuffers(source);
+		if (!block) {
+			debug_log("decompressBuffer: failed to consolidate source\n\r");
+			return nullptr;
+		}
+		output_count = agon_lz_decompress(block->getBuffer() + skip_hdr, block->size() - skip_hdr, buffer, orig_size);
+	} else {
+		DecompressionData dd;
+		agon_init_decompression(&dd, nullptr, nullptr, orig_size);
+
+		// loop thru the blocks, skipping the header at the start of the first one
+		dd.input_count = skip_hdr;
+		for (const auto &block : source) {
+			if (!agon_decompress_block(&dd, block->getBuffer() + skip_hdr, block->size() - skip_hdr, buffer)) {
+				debug_log("decompressBuffer: data decompresses to more than %u bytes\n\r", orig_size);
+				break;
+			}
+			skip_hdr = 0;
+		}
+		output_count = dd.output_count;
+	}
+
+	if (output_count != orig_size) {
+		debug_log("Decompressed buffer size %u does not equal original size %u\r\n",
+					output_count, orig_size);
+	}
+	return bufferStream;
+}
+
+class DecompressionCache {
+	public:
+		std::shared_ptr<const BufferVector> get(uint16_t bufferId, const BufferVector &source);
+		void invalidate(uint16_t bufferId);
+		void clear();
+
+	private:
+		struct Entry {
+			uint16_t							bufferId;
+			uint32_t							lastUse;
+			std::shared_ptr<const BufferVector>	data;
+		};
+
+		std::vector<Entry, psram_allocator<Entry>> entries;
+		uint32_t	totalSize = 0;
+		uint32_t	useCount = 0;
+
+		void makeRoom(uint32_t size);
+};
+
+DecompressionCache decompressionCache;
+
+// Get the decompressed contents of a buffer, decompressing it if it isn't already cached
+// Returns nullptr if the buffer couldn't be decompressed
+//
+std::shared_ptr<const BufferVector> DecompressionCache::get(uint16_t bufferId, const BufferVector &source) {
+	for (auto &entry : entries) {
+		if (entry.bufferId == bufferId) {
+			entry.lastUse = ++useCount;
+			return entry.data;
+		}
+	}
+
+	auto block = decompressBuffer(source);
+	if (!block) {
+		return nullptr;
+	}
+	auto size = block->size();
+	auto data = make_shared_psram<BufferVector>();
+	data->push_back(std::move(block));
+	debug_log("DecompressionCache: decompressed buffer %d, %u bytes\n\r", bufferId, size);
+
+	if (size > DECOMPRESSION_CACHE_SIZE) {
+		// too big to keep, so it lives only as long as the caller needs it
+		return data;
+	}
+	makeRoom(size);
+	entries.push_back({ bufferId, ++useCount, data });
+	totalSize += size;
+	return data;
+}
+
+// Drop the cached copy of a buffer, as its contents have changed
+// Blocks can be held by more than one buffer, after a copy by reference or a spread,
+// so cached copies of other buffers holding any of the same blocks are dropped too
+//
+void DecompressionCache::invalidate(uint16_t bufferId) {
+	if (entries.empty()) {
+		return;
+	}
+	auto bufferIter = buffers.find(bufferId);
+	auto sharesBlocks = [&](uint16_t otherId) {
+		if (otherId == bufferId) {
+			return true;
+		}
+		auto otherIter = buffers.find(otherId);
+		if (bufferIter == buffers.end() || otherIter == buffers.end()) {
+			return false;
+		}
+		auto &otherBlocks = otherIter->second;
+		for (const auto &block : bufferIter->second) {
+			if (std::find(otherBlocks.begin(), otherBlocks.end(), block) != otherBlocks.end()) {
+				return true;
+			}
+		}
+		return false;
+	};
+	for (auto entry = entries.begin(); entry != entries.end(); ) {
+		if (sharesBlocks(entry->bufferId)) {
+			totalSize -= entry->data->totalSize();
+			entry = entries.erase(entry);
+		} else {
+			++entry;
+		}
+	}
+}
+
+void DecompressionCache::clear() {
+	entries.clear();
+	totalSize = 0;
+}
+
+// Evict least recently used entries until there's room for the given number of bytes
+//
+void DecompressionCache::makeRoom(uint32_t size) {
+	while (!entries.empty() && totalSize + size > DECOMPRESSION_CACHE_SIZE) {
+		auto oldest = std::min_element(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+			return a.lastUse < b.lastUse;
+		});
+		debug_log("DecompressionCache: evicting buffer %d\n\r", oldest->bufferId);
+		totalSize -= oldest->data->totalSize();
+		entries.erase(oldest);
+	}
+}
+
+// Replace the contents of a compressed buffer with its decompressed data
+// for users that keep pointers into buffer memory, such as bitmaps and fonts
+// Returns false if the buffer is compressed and couldn't be decompressed
+//
+bool decompressInPlace(uint16_t bufferId) {
+	auto bufferIter = buffers.find(bufferId);
+	if (bufferIter == buffers.end() || !bufferIter->compressed) {
+		return true;
+	}
+	auto decompressed = decompressionCache.get(bufferId, bufferIter->second);
+	if (!decompressed) {
+		return false;
+	}
+	bufferIter->second.assign(decompressed->begin(), decompressed->end());
+	bufferIter->compressed = false;
+	decompressionCache.invalidate(bufferId);
+	debug_log("decompressInPlace: buffer %d decompressed\n\r", bufferId);
+	return true;
+}
+
+#endif // DECOMPRESSION_CACHE_H
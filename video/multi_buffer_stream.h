@@ -6,11 +6,17 @@
 #include <Stream.h>
 
 #include "buffer_stream.h"
+#include "buffers.h"
 #include "types.h"
 
-class MultiBufferStream : public Stream {
+class MultiBufferStream : public Stream, private BufferVector::Reader {
 	public:
-		MultiBufferStream(BufferVector buffers);
+		MultiBufferStream() {}
+		MultiBufferStream(const BufferVector &buffers);
+		~MultiBufferStream();
+		void attach(const BufferVector &buffers);
+		void attach(std::shared_ptr<const BufferVector> buffers);
+		void detach();
 		int available();
 		int read();
 		int peek();
@@ -23,17 +29,74 @@ class MultiBufferStream : public Stream {
 		void seekTo(uint32_t position, size_t bufferIndex = 0);
 		uint32_t size();
 		const BufferVector &tellBuffer(uint32_t &blockOffset, size_t &blockIndex);
+		const uint8_t * peekBlock(size_t &length);
+		void skipBytes(size_t length);
 	private:
-		BufferVector buffers;
+		// The blocks are referenced rather than copied, so the vector must outlive the stream
+		// (entries in the buffers table are never moved) unless it's held by ownedBuffers
+		// A referenced vector is copied into ownedBuffers before it changes, so a buffer that
+		// writes to or clears itself while running keeps running the blocks it started with
+		// The block currently being read is held so it survives its buffer being cleared or rewritten
+		const BufferVector * buffers = nullptr;
+		std::shared_ptr<const BufferVector> ownedBuffers;
+		std::shared_ptr<BufferStream> currentBuffer;
 		BufferStream * getBuffer();
 		size_t currentBufferIndex = 0;
+		void blocksChanging(const BufferVector &blocks);
 };
 
-MultiBufferStream::MultiBufferStream(BufferVector buffers) : buffers(std::move(buffers)) {
-	// rewind to the start of the first buffer
+MultiBufferStream::MultiBufferStream(const BufferVector &buffers) {
+	attach(buffers);
+}
+
+MultiBufferStream::~MultiBufferStream() {
+	detach();
+}
+
+// Point this stream at a set of blocks, rewinding to the start of the first block
+//
+void MultiBufferStream::attach(const BufferVector &buffers) {
+	detach();
+	this->buffers = &buffers;
+	buffers.addReader(this);
+	rewind();
+}
+
+// As above, keeping hold of the blocks until the stream is detached or attached elsewhere
+//
+void MultiBufferStream::attach(std::shared_ptr<const BufferVector> buffers) {
+	detach();
+	this->buffers = buffers.get();
+	ownedBuffers = std::move(buffers);
 	rewind();
 }
 
+// Release the blocks, leaving the stream empty until it is next attached
+//
+void MultiBufferStream::detach() {
+	if (buffers && !ownedBuffers) {
+		buffers->removeReader(this);
+	}
+	currentBuffer.reset();
+	currentBufferIndex = 0;
+	buffers = nullptr;
+	ownedBuffers.reset();
+}
+
+// Take a copy of the referenced blocks before they change, keeping our place in them
+//
+void MultiBufferStream::blocksChanging(const BufferVector &blocks) {
+	auto copy = make_shared_psram<BufferVector>(blocks);
+	if (!copy) {
+		// carry on with just the current block
+		debug_log("MultiBufferStream: failed to copy blocks of a running buffer\n\r");
+		buffers = nullptr;
+		return;
+	}
+	buffers = copy.get();
+	ownedBuffers = std::move(copy);
+}
+
 int MultiBufferStream::available() {
 	auto buffer = getBuffer();
 	if (buffer) {
@@ -77,56 +140,82 @@ size_t MultiBufferStream::write(uint8_t b) {
 
 void MultiBufferStream::rewind(size_t bufferIndex) {
 	currentBufferIndex = bufferIndex;
-	if (currentBufferIndex < buffers.size()) {
-		buffers[currentBufferIndex]->rewind();
+	if (buffers && currentBufferIndex < buffers->size()) {
+		currentBuffer = (*buffers)[currentBufferIndex];
+		currentBuffer->rewind();
+	} else {
+		currentBuffer.reset();
 	}
 }
 
 void MultiBufferStream::seekTo(uint32_t position, size_t bufferIndex) {
 	// find the buffer that contains the position we want
-	// keeping track of an offset into the whole buffer
-	auto offset = position;
-	for (auto i = bufferIndex; i < buffers.size(); i++) {
-		auto &stream = buffers[i];
-		auto bufferSize = stream->size();
-		if (offset < bufferSize) {
-			// this is the buffer we want
-			currentBufferIndex = i;
-			stream->seekTo(offset);
+	// position is relative to the start of the given buffer index
+	if (!buffers) {
+		currentBuffer.reset();
+		currentBufferIndex = 0;
+		return;
+	}
+	if (bufferIndex < buffers->size()) {
+		auto offset = buffers->blockStart(bufferIndex) + position;
+		auto index = buffers->findBlock(offset);
+		if (index < buffers->size()) {
+			currentBufferIndex = index;
+			currentBuffer = (*buffers)[index];
+			currentBuffer->seekTo(offset - buffers->blockStart(index));
 			return;
 		}
-		// reduce the offset by the size of this buffer, as position wasn't there
-		offset -= bufferSize;
 	}
 
 	// if we get here, we've gone past the end of the buffers
 	// so just seek past the end of the last buffer
-	currentBufferIndex = buffers.size();
+	currentBuffer.reset();
+	currentBufferIndex = buffers->size();
 }
 
 uint32_t MultiBufferStream::size() {
-	uint32_t totalSize = 0;
-	for (auto &buffer : buffers) {
-		totalSize += buffer->size();
-	}
-	return totalSize;
+	return buffers ? buffers->totalSize() : 0;
 }
 
 const BufferVector &MultiBufferStream::tellBuffer(uint32_t &blockOffset, size_t &blockIndex) {
 	auto buffer = getBuffer();
 	blockOffset = buffer ? buffer->tell() : 0;
 	blockIndex = currentBufferIndex;
-	return buffers;
+	if (!buffers) {
+		static const BufferVector noBuffers;
+		return noBuffers;
+	}
+	return *buffers;
+}
+
+// Get direct access to the unread bytes of the current block
+// Returns a pointer to the next byte, and the number of bytes left in the block
+//
+const uint8_t * MultiBufferStream::peekBlock(size_t &length) {
+	auto buffer = getBuffer();
+	if (!buffer) {
+		length = 0;
+		return nullptr;
+	}
+	length = buffer->available();
+	return buffer->getBuffer() + buffer->tell();
+}
+
+// Skip over bytes in the current block
+// NB length must not exceed the length returned from peekBlock
+//
+void MultiBufferStream::skipBytes(size_t length) {
+	auto buffer = getBuffer();
+	if (buffer) {
+		buffer->seekTo(buffer->tell() + length);
+	}
 }
 
 inline BufferStream * MultiBufferStream::getBuffer() {
-	while (currentBufferIndex < buffers.size() && !buffers[currentBufferIndex]->available()) {
+	while (currentBuffer && !currentBuffer->available()) {
 		rewind(currentBufferIndex + 1);
 	}
-	if (currentBufferIndex >= buffers.size()) {
-		return nullptr;
-	}
-	return buffers[currentBufferIndex].get();
+	return currentBuffer.get();
 }
 
 #endif // MULTI_BUFFER_STREAM_H
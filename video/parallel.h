@@ -0,0 +1,70 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Sharing work between the cores
+//
+// The VDU processor runs on core 0, and core 1 is mostly left to the video
+// driver.  Work that splits into independent jobs, such as compressing a
+// large buffer in chunks, can be shared with a worker task on the other core.
+//
+// Jobs are handed out in order from a shared counter, so both cores keep busy
+// however uneven the jobs are, and if the worker is slow to start the calling
+// core just does more of the jobs itself.  Jobs must not use the VDU processor
+// or the buffers table, as they may run on either core.
+
+#include <atomic>
+#include <functional>
+#include <Arduino.h>
+
+#include "agon.h"
+
+struct ParallelRun {
+	const std::function<void(uint32_t)> *	job;
+	uint32_t								count;
+	std::atomic<uint32_t>					next;
+	TaskHandle_t							caller;
+};
+
+void runParallelJobs(ParallelRun &run) {
+	uint32_t index;
+	while ((index = run.next.fetch_add(1)) < run.count) {
+		(*run.job)(index);
+	}
+}
+
+void parallelWorker(void * parameter) {
+	auto run = (ParallelRun *)parameter;
+	runParallelJobs(*run);
+	xTaskNotifyGive(run->caller);
+	vTaskDelete(nullptr);
+}
+
+// Run job(index) for each index from 0 to count - 1, shared between this core and the other one
+// Returns when all of the jobs have finished
+//
+void runOnBothCores(uint32_t count, const std::function<void(uint32_t)> &job) {
+	ParallelRun run;
+	run.job = &job;
+	run.count = count;
+	run.next = 0;
+	run.caller = xTaskGetCurrentTaskHandle();
+
+	auto started = count > 1 && xTaskCreatePinnedToCore(parallelWorker, "parallelWorker",
+		PARALLEL_WORKER_STACK,
+		&run,
+		PARALLEL_WORKER_PRIORITY,
+		nullptr,
+		1 - xPortGetCoreID()
+	) == pdPASS;
+	if (count > 1 && !started) {
+		debug_log("runOnBothCores: failed to start worker, running %d jobs on one core\n\r", count);
+	}
+
+	runParallelJobs(run);
+	if (started) {
+		// wait for the worker to finish its last job
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+}
+
+#endif // PARALLEL_H
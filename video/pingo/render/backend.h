@@ -22,6 +22,9 @@ typedef struct tag_BackEnd {
     //Should return the address of the buffer (height*width*sizeof(Pixel))
     PingoDepth * (*getZetaBuffer)(Renderer *, struct tag_BackEnd * );
 
+    //Runs job(data, index) for each index below count, possibly in parallel, and returns when all are done
+    void (*runJobs)(int count, void (*job)(void * data, int index), void * data);
+
     //Allows for referencing client-custom data structure
     void* clientCustomData;
 } BackEnd;
@@ -1,32 +1,38 @@
+#include <string.h>
+
 #include "depth.h"
 
-#ifdef ZBUFFER32
-void depth_write (PingoDepth * d, int idx, float value) {
-    d[idx].d = (uint32_t)(value * (float)UINT32_MAX);
-}
+void depth_set_format(PingoDepth * d, DepthFormat format, int epoch_bits) {
+    int bits = format == DEPTH_16 ? 16 : 32;
+    int value_bits = bits - epoch_bits;
 
-bool depth_check(PingoDepth * d, int idx, float value){
-    return (uint32_t)(value * (float)UINT32_MAX) < d[idx].d;
-}
-#endif
+    d->format = format;
+    d->epoch_bits = epoch_bits;
+    d->scale = value_bits == 32 ? (float)UINT32_MAX : (float)((1u << value_bits) - 1);
+    d->shift = 32 - value_bits;
 
-#ifdef ZBUFFER16
-void depth_write (PingoDepth * d, int idx, float value) {
-    d[idx].d = (uint16_t)(value * UINT16_MAX);
+    // The last epoch, so the next frame starts with a clear
+    d->epoch = (1u << epoch_bits) - 1;
 }
 
-bool depth_check(PingoDepth * d, int idx, float value){
-    return (uint16_t)(value * UINT16_MAX) < d[idx].d;
-}
-#endif
+void depth_begin_frame(PingoDepth * d) {
+    int bits = d->format == DEPTH_16 ? 16 : 32;
+    int value_bits = bits - d->epoch_bits;
 
-#ifdef ZBUFFER8
-void depth_write (PingoDepth * d, int idx, float value) {
-    d[idx].d = (uint8_t)(value * UINT8_MAX);
+    // Values from earlier epochs are all below the current base,
+    // so they count as behind everything drawn in the current frame
+    d->epoch++;
+    if (d->epoch >> d->epoch_bits) {
+        d->epoch = 0;
+    }
+    d->base = value_bits < 32 ? d->epoch << value_bits : 0;
+    d->clearing = d->epoch == 0;
 }
 
-bool depth_check(PingoDepth * d, int idx, float value){
-    return (uint8_t)(value * UINT8_MAX) > d[idx].d;
+void depth_clear(PingoDepth * d, int first, int count) {
+    if (d->format == DEPTH_16) {
+        memset((uint16_t *) d->values + first, 0, count * sizeof(uint16_t));
+    } else {
+        memset((uint32_t *) d->values + first, 0, count * sizeof(uint32_t));
+    }
 }
-#endif
-
@@ -3,26 +3,58 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define ZBUFFER32 // [ZBUFFER32 | ZBUFFER16 | ZBUFFER8]
+// Depth values are 1/z as a fraction of the full range, so larger values are nearer,
+// and a cleared buffer is all 0
+
+typedef enum {
+    DEPTH_32 = 0,   // 32 bit values
+    DEPTH_16 = 1    // 16 bit values, halving the memory traffic
+} DepthFormat;
+
+#define DEPTH_EPOCH_BITS 8  // Default number of frames between clears, as a power of 2
 
-#ifdef ZBUFFER32
 typedef struct tag_PingoDepth {
-    uint32_t d;
+    void * values;          // One value per pixel, in the format below
+    DepthFormat format;
+    int epoch_bits;         // Top bits of each value, holding the frame since the last clear it was written in
+    uint32_t epoch;         // Frames since the last clear
+    uint32_t base;          // The epoch shifted into the top bits, added to every value written
+    float scale;            // Converts a depth fraction to value steps
+    int shift;              // Converts a 0.32 fixed point depth fraction to value steps
+    bool clearing;          // Set when the values need clearing for the current frame
 } PingoDepth;
-#endif
 
-#ifdef ZBUFFER16
-typedef struct Depth {
-    uint16_t d;
-} Depth;
-#endif
+// Select the format and epoch bits, so the values are cleared before the next frame
+void depth_set_format(PingoDepth * d, DepthFormat format, int epoch_bits);
+
+// Start a new frame, moving on to the next epoch, or back to the first if the values need clearing
+void depth_begin_frame(PingoDepth * d);
+
+// Clear count values from the first
+void depth_clear(PingoDepth * d, int first, int count);
+
+// Value to compare and write for a depth fraction
+static inline uint32_t depth_value(const PingoDepth * d, float value) {
+    return (uint32_t)(value * d->scale) + d->base;
+}
 
-#ifdef ZBUFFER8
-typedef struct Depth {
-    uint8_t d;
-} Depth;
-#endif
+// Fixed point version, with the depth as a 0.32 fraction
+static inline uint32_t depth_value_fixed(const PingoDepth * d, uint32_t value) {
+    return (value >> d->shift) + d->base;
+}
 
-void depth_write(PingoDepth * d, int idx, float value);
-bool depth_check(PingoDepth * d, int idx, float value);
+// Returns true if the value is behind the one already at idx
+static inline bool depth_check(const PingoDepth * d, int idx, uint32_t value) {
+    if (d->format == DEPTH_16) {
+        return value < ((const uint16_t *) d->values)[idx];
+    }
+    return value < ((const uint32_t *) d->values)[idx];
+}
 
+static inline void depth_write(const PingoDepth * d, int idx, uint32_t value) {
+    if (d->format == DEPTH_16) {
+        ((uint16_t *) d->values)[idx] = (uint16_t) value;
+    } else {
+        ((uint32_t *) d->values)[idx] = value;
+    }
+}
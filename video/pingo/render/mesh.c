@@ -1,5 +1,37 @@
+#include <math.h>
+
 #include "mesh.h"
 
+void meshComputeBounds(Mesh * mesh)
+{
+    mesh->bounds_center = (Vec3f){0, 0, 0};
+    mesh->bounds_radius = 0;
+    if (!mesh->positions || mesh->positions_count <= 0)
+        return;
+
+    // Centre the sphere on the middle of the bounding box
+    Vec3f lo = mesh->positions[0];
+    Vec3f hi = lo;
+    for (int i = 1; i < mesh->positions_count; i++) {
+        Vec3f p = mesh->positions[i];
+        lo.x = fminf(lo.x, p.x); hi.x = fmaxf(hi.x, p.x);
+        lo.y = fminf(lo.y, p.y); hi.y = fmaxf(hi.y, p.y);
+        lo.z = fminf(lo.z, p.z); hi.z = fmaxf(hi.z, p.z);
+    }
+    Vec3f c = { (lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f };
+
+    // and make it just large enough to take in the furthest position
+    float r2 = 0;
+    for (int i = 0; i < mesh->positions_count; i++) {
+        Vec3f p = mesh->positions[i];
+        float dx = p.x - c.x, dy = p.y - c.y, dz = p.z - c.z;
+        r2 = fmaxf(r2, dx * dx + dy * dy + dz * dz);
+    }
+
+    mesh->bounds_center = c;
+    mesh->bounds_radius = sqrtf(r2);
+}
+
 
 
 
@@ -9,6 +9,12 @@ typedef struct Mesh {
     int indexes_count;
     uint16_t * pos_indices;
     Vec3f * positions;
+    int positions_count;
+    Vec3f bounds_center;    // Bounding sphere of the positions, for culling objects outside the view
+    float bounds_radius;
 } Mesh;
 
+// Set the bounding sphere to enclose all of the mesh's positions
+void meshComputeBounds(Mesh * mesh);
+
 
@@ -16,10 +16,40 @@
 #define MAX(a, b)(((a) > (b)) ? (a) : (b))
 #define Z_THRESHOLD 0.000001f
 
+// Fixed point rasterization
+#define FIXED_SUBPIXEL_BITS 5       // Raster positions are 27.5 fixed point
+#define FIXED_ATTR_BITS 30          // Barycentrics, 1/z, u/z and v/z are 2.30 fixed point
+#define FIXED_ATTR_ONE (1 << FIXED_ATTR_BITS)
+#define FIXED_MAX_EXTENT 512        // Larger triangles use the float rasterizer, as edge values would overflow
+
+// Tiled rendering
+#define TILE_ROWS 16                // Height of each tile, which spans the full width of the frame
+#define TILE_MIN_TRIANGLES 256      // Initial size of the triangle list
+
 #if DEBUG
 extern void show_pixel(float x, float y, uint8_t a, uint8_t b, uint8_t g, uint8_t r);
 #endif
 
+// SCRATCHPIXEL FUNCTIONS
+// https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/perspective-correct-interpolation-vertex-attributes.html
+static inline void persp_divide(struct Vec3f* p);
+static inline void to_raster(const Vec2i size, struct Vec3f* const p);
+static inline void tri_bbox(const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, float* const bbox);
+static inline float edge(const Vec3f* const a, const Vec3f* const b, const Vec3f* const test);
+static Pixel shade(const Texture* texture, Vec2f uv);
+static inline uint32_t rasterize(int x0, int y0, int x1, int y1, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight);
+static uint32_t rasterize_triangle(Renderer * r, const RasterTriangle * t, int y0, int y1);
+static int rasterize_fixed(int x0, int y0, int x1, int y1, const float* const bbox, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight);
+static Pixel shade_fixed(const Texture* texture, int32_t u, int32_t v, int32_t inv_z);
+static void clear_rows(Renderer * r, int y0, int y1);
+static void finish_frame(Renderer * r);
+static void tiles_add(Renderer * r, const RasterTriangle * triangle);
+static void render_tile(void * data, int tile);
+static int render_tiles(Renderer * r);
+static int sphere_in_view(const Mat4 * mvp, const Mesh * mesh, float near);
+static const Vec3f * transform_vertices(Renderer * r, const Mesh * mesh, Mat4 * mvp);
+static inline int span_limit(float w_row, float w_dx, float* const span_start, float* const span_end);
+
 
 int rendererInit(Renderer * r, Vec2i size, BackEnd * backEnd) {
     printf("Initalizing Renderer\n");
@@ -31,15 +61,35 @@ int rendererInit(Renderer * r, Vec2i size, BackEnd * backEnd) {
     r->backEnd = backEnd;
 
     r->frameBuffer.size = size;
+    r->clip = (RenderRect) { 0, 0, size.x, size.y };
+    rendererInvalidate(r);
     printf("Frame buffer initialized\n");
 
-    int zsize = sizeof(PingoDepth) * size.x * size.y;
-    r->z_buffer = (PingoDepth*) heap_caps_malloc(zsize, MALLOC_CAP_SPIRAM);
+    // Sized for 32 bit values, so the format can be changed later
+    int zsize = sizeof(uint32_t) * size.x * size.y;
+    r->z_buffer.values = heap_caps_malloc(zsize, MALLOC_CAP_SPIRAM);
+    depth_set_format(&r->z_buffer, DEPTH_32, DEPTH_EPOCH_BITS);
     printf("Z buffer initialized\n");
+
+    r->tiles.tile_count = (size.y + TILE_ROWS - 1) / TILE_ROWS;
+    r->tiles.bin_starts = (uint32_t*) heap_caps_malloc((r->tiles.tile_count + 1) * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+    r->tiles.tile_pixels = (uint32_t*) heap_caps_malloc(r->tiles.tile_count * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
     printf("Renderer initialized\n");
     return 0;
 }
 
+void rendererInvalidate(Renderer * r) {
+    r->dirty = (RenderRect) { 0, 0, r->frameBuffer.size.x, r->frameBuffer.size.y };
+    r->target.drawn_before = r->dirty;
+}
+
+void rendererSetClip(Renderer * r, RenderRect clip) {
+    r->clip.x0 = MAX(0, clip.x0);
+    r->clip.y0 = MAX(0, clip.y0);
+    r->clip.x1 = MIN(r->frameBuffer.size.x, clip.x1);
+    r->clip.y1 = MIN(r->frameBuffer.size.y, clip.y1);
+}
+
 int rendererSetScene(Renderer * r, Scene * s) {
     if (s == 0)
         return 1; //nullptr scene
@@ -60,6 +110,15 @@ int renderFrame(Renderer * r, Renderable ren) {
 };
 
 int renderSprite(Mat4 transform, Renderer * r, Renderable ren) {
+    // Sprites are drawn straight into the frame, so a scene with sprites isn't rendered in tiles
+    if (r->tiles.collecting) {
+        r->tiles.overflow = 1;
+        return 0;
+    }
+
+    // The area a sprite covers isn't tracked, so the whole frame will need clearing
+    r->drawn = (RenderRect) { 0, 0, r->frameBuffer.size.x, r->frameBuffer.size.y };
+
     Sprite * s = ren.impl;
     Mat4 backUp = s->t;
 
@@ -92,27 +151,225 @@ int renderScene(Mat4 transform, Renderer * r, Renderable ren) {
     return 0;
 };
 
-int rendererRender(Renderer * r) {
-    int num_pixels = r->frameBuffer.size.x * r->frameBuffer.size.y;
+// Clear the rows from y0 up to y1 of the depth buffer if this frame needs it,
+// and the part of them in the frame buffer or display that was drawn in the last frame
+static void clear_rows(Renderer * r, int y0, int y1) {
+    int width = r->frameBuffer.size.x;
 
-    memset(r->z_buffer, 0, num_pixels * sizeof (PingoDepth));
+    if (r->z_buffer.clearing) {
+        depth_clear(&r->z_buffer, y0 * width, (y1 - y0) * width);
+    }
+
+    const RenderRect * dirty = &r->dirty;
+    int x0 = MAX(dirty->x0, r->clip.x0);
+    int x1 = MIN(dirty->x1, r->clip.x1);
+    y0 = MAX(y0, MAX(dirty->y0, r->clip.y0));
+    y1 = MIN(y1, MIN(dirty->y1, r->clip.y1));
+    if (x0 >= x1 || r->clear == REND_NO_CLEAR) {
+        return;
+    }
+    int num_pixels = x1 - x0;
+
+    for (int y = y0; y < y1; y++) {
+        int offset = y * width + x0;
+        if (r->target.rows) {
+            // Display pixels are converted one at a time, as they may be stored out of order
+            const RenderTarget * target = &r->target;
+            uint8_t * row = target->rows[y];
+            for (int x = x0; x < x1; x++) {
+                Pixel color = r->clear == REND_BACKGROUND ? r->background.pixels[offset + x - x0] : r->clearColor;
+                row[(target->x + x) ^ target->swizzle] = target->native[color.c];
+            }
+            continue;
+        }
+        Pixel* framePixels = r->frameBuffer.pixels + offset;
+        if (r->clear == REND_CLEAR) {
+            memset(framePixels, r->clearColor.c, num_pixels * sizeof(Pixel));
+        } else if (r->clear == REND_BACKGROUND) {
+            Pixel* backgroundPixels = r->background.pixels + offset;
+            memcpy(framePixels, backgroundPixels, num_pixels * sizeof(Pixel));
+        }
+    }
+}
 
-    Pixel* framePixels = r->frameBuffer.pixels;
-    if (r->clear == REND_CLEAR) {
-        memset(framePixels, r->clearColor.c, num_pixels * sizeof(Pixel));
-    } else if (r->clear == REND_BACKGROUND) {
-        Pixel* backgroundPixels = r->background.pixels;
-        memcpy(framePixels, backgroundPixels, num_pixels * sizeof(Pixel));
+int rendererRender(Renderer * r) {
+    memset(&r->stats, 0, sizeof(RenderStats));
+    depth_begin_frame(&r->z_buffer);
+    r->drawn = (RenderRect) { r->frameBuffer.size.x, r->frameBuffer.size.y, 0, 0 };
+
+    if (r->tiled && r->backEnd && r->backEnd->runJobs && r->tiles.bin_starts && r->tiles.tile_pixels) {
+        // Set up every triangle first, then clear and rasterize the frame a tile at a time
+        r->tiles.count = 0;
+        r->tiles.overflow = 0;
+        r->tiles.collecting = 1;
+        renderScene(mat4Identity(), r, sceneAsRenderable(r->scene));
+        r->tiles.collecting = 0;
+
+        if (!r->tiles.overflow && render_tiles(r)) {
+            finish_frame(r);
+            return 0;
+        }
+        // couldn't be rendered in tiles, so fall back to drawing triangles as they are set up
+        memset(&r->stats, 0, sizeof(RenderStats));
     }
 
+    clear_rows(r, 0, r->frameBuffer.size.y);
     renderScene(mat4Identity(), r, sceneAsRenderable(r->scene));
 
+    finish_frame(r);
     return 0;
 }
 
+// Only what was drawn will need clearing the next time the frame is drawn into the same buffer
+static void finish_frame(Renderer * r) {
+    if (r->target.rows && r->target.double_buffered) {
+        // The next frame is drawn into the buffer on show now, which still holds the frame before this one
+        r->dirty = r->target.drawn_before;
+        r->target.drawn_before = r->drawn;
+    } else {
+        r->dirty = r->drawn;
+    }
+}
+
+// Add a set up triangle to the list for tiled rendering
+static void tiles_add(Renderer * r, const RasterTriangle * triangle) {
+    RenderTiles * tiles = &r->tiles;
+    if (tiles->count == tiles->capacity) {
+        uint32_t capacity = tiles->capacity ? tiles->capacity * 2 : TILE_MIN_TRIANGLES;
+        RasterTriangle * triangles = (RasterTriangle*) heap_caps_realloc(tiles->triangles, capacity * sizeof(RasterTriangle), MALLOC_CAP_SPIRAM);
+        if (!triangles) {
+            tiles->overflow = 1;
+            return;
+        }
+        tiles->triangles = triangles;
+        tiles->capacity = capacity;
+    }
+    tiles->triangles[tiles->count++] = *triangle;
+}
+
+// Clear and rasterize one tile, with the triangles binned to it in the order they were set up
+static void render_tile(void * data, int tile) {
+    Renderer * r = (Renderer *) data;
+    RenderTiles * tiles = &r->tiles;
+    int y0 = tile * TILE_ROWS;
+    int y1 = MIN(r->frameBuffer.size.y, y0 + TILE_ROWS) - 1;
+
+    clear_rows(r, y0, y1 + 1);
+
+    uint32_t pixels = 0;
+    for (uint32_t i = tiles->bin_starts[tile]; i < tiles->bin_starts[tile + 1]; i++) {
+        const RasterTriangle * triangle = &tiles->triangles[tiles->bins[i]];
+        pixels += rasterize_triangle(r, triangle, MAX(triangle->y0, y0), MIN(triangle->y1, y1));
+    }
+    tiles->tile_pixels[tile] = pixels;
+}
+
+// Bin the triangles into tiles, and rasterize the tiles as jobs shared between cores
+// Returns 0 if the bins couldn't be allocated
+static int render_tiles(Renderer * r) {
+    RenderTiles * tiles = &r->tiles;
+    int tile_count = tiles->tile_count;
+
+    // Count the triangles in each tile, then turn the counts into the end of each tile's bin
+    memset(tiles->bin_starts, 0, (tile_count + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < tiles->count; i++) {
+        for (int tile = tiles->triangles[i].y0 / TILE_ROWS; tile <= tiles->triangles[i].y1 / TILE_ROWS; tile++) {
+            tiles->bin_starts[tile]++;
+        }
+    }
+    uint32_t total = 0;
+    for (int tile = 0; tile < tile_count; tile++) {
+        total += tiles->bin_starts[tile];
+        tiles->bin_starts[tile] = total;
+    }
+    tiles->bin_starts[tile_count] = total;
+
+    if (total > tiles->bins_capacity) {
+        heap_caps_free(tiles->bins);
+        tiles->bins = (uint32_t*) heap_caps_malloc(total * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+        tiles->bins_capacity = tiles->bins ? total : 0;
+        if (!tiles->bins) {
+            return 0;
+        }
+    }
+
+    // Filling each bin from its end, working back through the triangles,
+    // keeps them in the order they were set up, and leaves bin_starts at the start of each bin
+    for (uint32_t i = tiles->count; i-- > 0;) {
+        for (int tile = tiles->triangles[i].y0 / TILE_ROWS; tile <= tiles->triangles[i].y1 / TILE_ROWS; tile++) {
+            tiles->bins[--tiles->bin_starts[tile]] = i;
+        }
+    }
+
+    r->backEnd->runJobs(tile_count, &render_tile, r);
+
+    for (int tile = 0; tile < tile_count; tile++) {
+        r->stats.pixels += tiles->tile_pixels[tile];
+    }
+    return 1;
+}
+
+// Check whether any of a mesh's bounding sphere is inside the view frustum
+// A point is in view if its device z is below -near and its device x and y are within -z of 0,
+// so each side of the frustum is a linear function of the object space position,
+// taken from the rows of the combined matrix, that is positive outside the view
+static int sphere_in_view(const Mat4 * mvp, const Mesh * mesh, float near) {
+    const float * x = &mvp->elements[0];
+    const float * y = &mvp->elements[4];
+    const float * z = &mvp->elements[8];
+    const float planes[5][4] = {
+        { z[0] + x[0], z[1] + x[1], z[2] + x[2], z[3] + x[3] },
+        { z[0] - x[0], z[1] - x[1], z[2] - x[2], z[3] - x[3] },
+        { z[0] + y[0], z[1] + y[1], z[2] + y[2], z[3] + y[3] },
+        { z[0] - y[0], z[1] - y[1], z[2] - y[2], z[3] - y[3] },
+        { z[0], z[1], z[2], z[3] + near }
+    };
+
+    const Vec3f * c = &mesh->bounds_center;
+    for (int i = 0; i < 5; i++) {
+        const float * p = planes[i];
+        float distance = p[0] * c->x + p[1] * c->y + p[2] * c->z + p[3];
+        float scale = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        if (distance > mesh->bounds_radius * scale)
+            return 0;
+    }
+    return 1;
+}
+
+// Transform a mesh's positions into device coordinates, keeping z for the near plane test
+// Returns NULL if there is nothing to transform, or the vertex list couldn't be allocated
+static const Vec3f * transform_vertices(Renderer * r, const Mesh * mesh, Mat4 * mvp) {
+    uint32_t count = mesh->positions_count;
+    if (!count || !mesh->positions) {
+        return NULL;
+    }
+    if (count > r->vertices_capacity) {
+        Vec3f * vertices = (Vec3f*) heap_caps_realloc(r->vertices, count * sizeof(Vec3f), MALLOC_CAP_SPIRAM);
+        if (!vertices) {
+            return NULL;
+        }
+        r->vertices = vertices;
+        r->vertices_capacity = count;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const Vec3f * position = &mesh->positions[i];
+        Vec4f vertex = { position->x, position->y, position->z, 1 };
+        vertex = mat4MultiplyVec4(&vertex, mvp);
+
+        Vec3f * out = &r->vertices[i];
+        *out = (Vec3f) { vertex.x, vertex.y, vertex.z };
+        // CORRECTED WITH SCRATCHPIXEL: 
+        // convert to device coordinates by perspective division
+        persp_divide(out);
+    }
+    return r->vertices;
+}
+
 int renderObject(Mat4 object_transform, Renderer * r, Renderable ren) {
 
     const Vec2i scrSize = r->frameBuffer.size;
+    const RenderRect clip = r->clip;
     Object * o = ren.impl;
     Vec2f * tex_coords = o->textCoord;
     // printf("Texture coordinates: %p\n", tex_coords);
@@ -138,22 +395,37 @@ int renderObject(Mat4 object_transform, Renderer * r, Renderable ren) {
     cameraNormal = vec3Normalize(cameraNormal);
     // printf("Camera normal\n");
 
+    // MODEL, VIEW AND PROJECTION COMBINED
+    // mat4MultiplyVec4 takes w as 1, which holds between the model and view
+    // matrices as they are affine, so one transform per vertex gives the same result
+    Mat4 mv = mat4MultiplyM( &m, &v );
+    Mat4 mvp = mat4MultiplyM( &mv, &p );
+
+    // Objects entirely outside the view are skipped before any vertices are transformed
+    if (!sphere_in_view(&mvp, o->mesh, near)) {
+        r->stats.objects_culled++;
+        return 0;
+    }
+    r->stats.objects_drawn++;
+
+    // Vertices shared between triangles are only transformed once
+    const Vec3f * vertices = transform_vertices(r, o->mesh, &mvp);
+    if (!vertices)
+        return 0;
+    const uint32_t vertex_count = o->mesh->positions_count;
+
     // printf("Preparing to render mesh %p\n", o->mesh);
     for (int i = 0; i < o->mesh->indexes_count; i += 3) {
-        Vec3f * ver1 = &o->mesh->positions[o->mesh->pos_indices[i+0]];
-        Vec3f * ver2 = &o->mesh->positions[o->mesh->pos_indices[i+1]];
-        Vec3f * ver3 = &o->mesh->positions[o->mesh->pos_indices[i+2]];
-        // printf("Got vertices\n");
-
-        Vec4f a =  { ver1->x, ver1->y, ver1->z, 1 };
-        Vec4f b =  { ver2->x, ver2->y, ver2->z, 1 };
-        Vec4f c =  { ver3->x, ver3->y, ver3->z, 1 };
-        // printf("Converted vertices to vec4\n");
+        uint16_t ia = o->mesh->pos_indices[i+0];
+        uint16_t ib = o->mesh->pos_indices[i+1];
+        uint16_t ic = o->mesh->pos_indices[i+2];
+        if (ia >= vertex_count || ib >= vertex_count || ic >= vertex_count)
+            continue;
 
-        a = mat4MultiplyVec4( &a, &m);
-        b = mat4MultiplyVec4( &b, &m);
-        c = mat4MultiplyVec4( &c, &m);
-        // printf("Transformed vertices\n");
+        Vec3f a = vertices[ia];
+        Vec3f b = vertices[ib];
+        Vec3f c = vertices[ic];
+        // printf("Got vertices\n");
 
         // // TODO: convert this to look up normals from the mesh
         // // FACE NORMAL
@@ -173,27 +445,10 @@ int renderObject(Mat4 object_transform, Renderer * r, Renderable ren) {
         //     diffuseLight = MIN(1.0, MAX(diffuseLight, 0));
         // }
 
-        a = mat4MultiplyVec4( &a, &v);
-        b = mat4MultiplyVec4( &b, &v);
-        c = mat4MultiplyVec4( &c, &v);
-        // printf("Viewed vertices\n");
-
-        a = mat4MultiplyVec4( &a, &p);
-        b = mat4MultiplyVec4( &b, &p);
-        c = mat4MultiplyVec4( &c, &p);
-        // printf("Projected vertices\n");
-
         // Don't render triangles completely behind the near clipping plane
         if (a.z > -near && b.z > -near && c.z > -near)
             continue;
 
-        // CORRECTED WITH SCRATCHPIXEL: 
-        // convert to device coordinates by perspective division
-        persp_divide((Vec3f *)&a);
-        persp_divide((Vec3f *)&b);
-        persp_divide((Vec3f *)&c);
-        // printf("Perspective division\n");
-
         // TODO: review this logic as face normals may obviate the need for this
         // and indeed be the better option to control exactly what faces are rendered
         float clocking = isClockWise(a.x, a.y, b.x, b.y, c.x, c.y);
@@ -202,24 +457,26 @@ int renderObject(Mat4 object_transform, Renderer * r, Renderable ren) {
             continue;
 
         // Convert to raster space
-        to_raster(scrSize, (Vec3f *)&a);
-        to_raster(scrSize, (Vec3f *)&b);
-        to_raster(scrSize, (Vec3f *)&c);
+        to_raster(scrSize, &a);
+        to_raster(scrSize, &b);
+        to_raster(scrSize, &c);
         // printf("Converted to raster space\n");
 
         float bbox[4];
-        tri_bbox((Vec3f *)&a, (Vec3f *)&b, (Vec3f *)&c, bbox);
+        tri_bbox(&a, &b, &c, bbox);
         // printf("Got bounding box\n");
 
         // Bounding box constraint
-        if (bbox[0] > scrSize.x - 1 || bbox[2] < 0 || bbox[1] > scrSize.y - 1 || bbox[3] < 0)
+        if (bbox[0] > clip.x1 - 1 || bbox[2] < clip.x0 || bbox[1] > clip.y1 - 1 || bbox[3] < clip.y0)
             continue;
         // printf("Bounding box constraint\n");
 
-        int x0 = MAX(0, (int)bbox[0]);
-        int y0 = MAX(0, (int)bbox[1]);
-        int x1 = MIN(scrSize.x - 1, (int)bbox[2]);
-        int y1 = MIN(scrSize.y - 1, (int)bbox[3]);
+        int x0 = MAX(clip.x0, (int)bbox[0]);
+        int y0 = MAX(clip.y0, (int)bbox[1]);
+        int x1 = MIN(clip.x1 - 1, (int)bbox[2]);
+        int y1 = MIN(clip.y1 - 1, (int)bbox[3]);
+        if (x0 > x1 || y0 > y1)
+            continue;
         // printf("Bounding box\n");
 
         Vec2f tca = {0, 0};
@@ -245,71 +502,296 @@ int renderObject(Mat4 object_transform, Renderer * r, Renderable ren) {
             // printf("No texture coordinates\n");
         }
 
-        // Rasterize the triangle with the new scratchpixel logic
-        rasterize(x0, y0, x1, y1, (Vec3f *)&a, (Vec3f *)&b, (Vec3f *)&c, &tca, &tcb, &tcc, o->material->texture, scrSize, r, near, diffuseLight);
+        // Grow the drawn area, so the next frame knows what to clear
+        r->drawn.x0 = MIN(r->drawn.x0, x0);
+        r->drawn.y0 = MIN(r->drawn.y0, y0);
+        r->drawn.x1 = MAX(r->drawn.x1, x1 + 1);
+        r->drawn.y1 = MAX(r->drawn.y1, y1 + 1);
+
+        RasterTriangle triangle = {
+            a, b, c,
+            tca, tcb, tcc,
+            { bbox[0], bbox[1], bbox[2], bbox[3] },
+            x0, y0, x1, y1,
+            o->material->texture, near, diffuseLight
+        };
+
+        // When rendering in tiles the triangle is rasterized later, otherwise straight away
+        if (r->tiles.collecting) {
+            tiles_add(r, &triangle);
+            continue;
+        }
+        r->stats.pixels += rasterize_triangle(r, &triangle, y0, y1);
 
     }
 
     return 0;
 };
 
-static inline void rasterize(int x0, int y0, int x1, int y1, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight) {
-    float inv_area = 1.0f / edge(p0, p1, p2);
+// Rasterize the rows y0 to y1 of a set up triangle
+// with the new scratchpixel logic, or in fixed point if enabled and the triangle is within its range
+// Returns the number of pixels drawn
+static uint32_t rasterize_triangle(Renderer * r, const RasterTriangle * t, int y0, int y1) {
+    int pixels = r->fixed_point ? rasterize_fixed(t->x0, y0, t->x1, y1, t->bbox, &t->a, &t->b, &t->c, &t->uva, &t->uvb, &t->uvc, t->texture, r->frameBuffer.size, r, t->near, t->light) : -1;
+    if (pixels < 0) {
+        pixels = rasterize(t->x0, y0, t->x1, y1, &t->a, &t->b, &t->c, &t->uva, &t->uvb, &t->uvc, t->texture, r->frameBuffer.size, r, t->near, t->light);
+    }
+    return pixels;
+}
 
-    Vec3f sample;
-    Vec2f intersections[2];
-    int intersection_count;
+static inline uint32_t rasterize(int x0, int y0, int x1, int y1, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight) {
+    float area = edge(p0, p1, p2);
+    if (area == 0) return 0;
+    float inv_area = 1.0f / area;
+
+    // The barycentric weights are linear in screen space, and so are 1/z, u/z and v/z
+    // which are built from them, so each is set up once as a value at the top left
+    // of the bounding box plus constant steps in x and y
+    Vec3f origin = { (float)x0, (float)y0, 0 };
+    float w0_origin = edge(p1, p2, &origin) * inv_area;
+    float w1_origin = edge(p2, p0, &origin) * inv_area;
+    float w2_origin = edge(p0, p1, &origin) * inv_area;
+    float w0_dx = (p2->y - p1->y) * inv_area;
+    float w1_dx = (p0->y - p2->y) * inv_area;
+    float w2_dx = (p1->y - p0->y) * inv_area;
+    float w0_dy = (p1->x - p2->x) * inv_area;
+    float w1_dy = (p2->x - p0->x) * inv_area;
+    float w2_dy = (p0->x - p1->x) * inv_area;
+
+    float inv_z0 = 1.0f / p0->z;
+    float inv_z1 = 1.0f / p1->z;
+    float inv_z2 = 1.0f / p2->z;
+    float inv_z_dx = w0_dx * inv_z0 + w1_dx * inv_z1 + w2_dx * inv_z2;
+    float u_dx = uv0->x * w0_dx + uv1->x * w1_dx + uv2->x * w2_dx;
+    float v_dx = uv0->y * w0_dx + uv1->y * w1_dx + uv2->y * w2_dx;
+
+    // A local copy of the depth buffer settings, so writes to it aren't taken to change them
+    const PingoDepth z_buffer = r->z_buffer;
+    uint32_t pixels = 0;
 
-    // Iterate over scanlines within the bounding box
     for (int scrY = y0; scrY <= y1; ++scrY) {
-        // Find the intersection points of the current scanline with the triangle edges
-        find_scanline_intersections(p0, p1, p2, scrY, intersections, &intersection_count);
-
-        // Continue only if exactly two intersection points are found
-        if (intersection_count != 2) continue;
-
-        // Sort the intersections by x-coordinate
-        int x_start = (int)MAX(x0, (int)intersections[0].x);
-        int x_end = (int)MIN(x1, (int)intersections[1].x);
-
-        // Iterate over pixels between the intersections on the current scanline
-        for (int scrX = x_start, index = scrY * scrSize.x + x_start; scrX <= x_end; ++scrX, ++index) {
-            sample.x = scrX;
-            sample.y = scrY;
-
-            // Barycentric coordinates for pixel coverage
-            float w0 = edge(p1, p2, &sample) * inv_area;
-            float w1 = edge(p2, p0, &sample) * inv_area;
-            float w2 = edge(p0, p1, &sample) * inv_area;
-
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                float inv_z = w0 / p0->z + w1 / p1->z + w2 / p2->z;
-                if (inv_z < -near) {
-                    continue;
-                }
+        float rows = (float)(scrY - y0);
+        float w0_row = w0_origin + rows * w0_dy;
+        float w1_row = w1_origin + rows * w1_dy;
+        float w2_row = w2_origin + rows * w2_dy;
+
+        // Solve each weight for the x where it crosses zero to find the covered span,
+        // widened by a pixel either side so the per-pixel test below decides the edges
+        float span_start = 0;
+        float span_end = (float)(x1 - x0);
+        if (!span_limit(w0_row, w0_dx, &span_start, &span_end) ||
+            !span_limit(w1_row, w1_dx, &span_start, &span_end) ||
+            !span_limit(w2_row, w2_dx, &span_start, &span_end)) {
+            continue;
+        }
+        int x_start = x0 + MAX(0, (int)ceilf(span_start) - 1);
+        int x_end = x0 + MIN(x1 - x0, (int)floorf(span_end) + 1);
+
+        float steps = (float)(x_start - x0);
+        float w0 = w0_row + steps * w0_dx;
+        float w1 = w1_row + steps * w1_dx;
+        float w2 = w2_row + steps * w2_dx;
+        float inv_z = w0 * inv_z0 + w1 * inv_z1 + w2 * inv_z2;
+        float u = uv0->x * w0 + uv1->x * w1 + uv2->x * w2;
+        float v = uv0->y * w0 + uv1->y * w1 + uv2->y * w2;
+
+        for (int scrX = x_start, index = scrY * scrSize.x + x_start; scrX <= x_end; ++scrX, ++index,
+                w0 += w0_dx, w1 += w1_dx, w2 += w2_dx, inv_z += inv_z_dx, u += u_dx, v += v_dx) {
+            if (w0 < 0 || w1 < 0 || w2 < 0 || inv_z < -near) {
+                continue;
+            }
+
+            uint32_t depth = depth_value(&z_buffer, -inv_z);
+            if (depth_check(&z_buffer, index, depth)) {
+                continue;
+            }
+
+            depth_write(&z_buffer, index, depth);
+
+            Pixel color = {255};
+            if (texture) {
+                // Perspective correct texture coordinates
                 float z = 1.0f / inv_z;
+                Vec2f uv = { u * z, v * z };
+
+                // Shade the pixel and update the color buffer
+                color = shade(texture, uv);
+            }
+
+            backendDrawPixel(r, &r->frameBuffer, (Vec2i) { scrX, scrY }, color, diffuseLight);
+            pixels++;
+        }
+    }
+
+    return pixels;
+}
+
+static inline int32_t to_fixed(float value, int bits) {
+    float scaled = value * (float)(1 << bits);
+    return (int32_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+}
+
+// Smallest k with base + k * step >= 0, for a positive step
+static inline int32_t ceil_steps(int32_t base, int32_t step) {
+    return base >= 0 ? 0 : (-base + step - 1) / step;
+}
+
+// Largest k with base + k * step >= 0, for a negative step
+static inline int32_t floor_steps(int32_t base, int32_t step) {
+    return base < 0 ? -1 : base / -step;
+}
+
+// Fixed point version of rasterize()
+//
+// Vertices are snapped to 1/32 of a pixel, and the edge functions are evaluated
+// exactly in integers, so each span is found without a per-pixel coverage test.
+// 1/z, u/z and v/z are stepped in 2.30 fixed point, and the triangle setup needs
+// a single division.  The float conversions at the start only take in the
+// results of the vertex transform.
+// Returns the number of pixels drawn, or -1 without drawing anything if the triangle
+// is outside the fixed point range, so the caller can use the float rasterizer instead.
+static int rasterize_fixed(int x0, int y0, int x1, int y1, const float* const bbox, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight) {
+    if (bbox[2] - bbox[0] > FIXED_MAX_EXTENT || bbox[3] - bbox[1] > FIXED_MAX_EXTENT)
+        return -1;
+
+    // 1/z, u/z and v/z at each vertex, as positive values
+    // vertices closer than z = -1 would not fit in 2.30 fixed point
+    float d[3] = { -1.0f / p0->z, -1.0f / p1->z, -1.0f / p2->z };
+    if (d[0] >= 1 || d[1] >= 1 || d[2] >= 1)
+        return -1;
+    float uz[3] = { -uv0->x, -uv1->x, -uv2->x };
+    float vz[3] = { -uv0->y, -uv1->y, -uv2->y };
+    for (int i = 0; i < 3; i++) {
+        if (fabsf(uz[i]) >= 1 || fabsf(vz[i]) >= 1)
+            return -1;
+    }
+
+    int32_t px[3] = { to_fixed(p0->x, FIXED_SUBPIXEL_BITS), to_fixed(p1->x, FIXED_SUBPIXEL_BITS), to_fixed(p2->x, FIXED_SUBPIXEL_BITS) };
+    int32_t py[3] = { to_fixed(p0->y, FIXED_SUBPIXEL_BITS), to_fixed(p1->y, FIXED_SUBPIXEL_BITS), to_fixed(p2->y, FIXED_SUBPIXEL_BITS) };
+
+    // Edge i is opposite vertex i, as for the weights in rasterize()
+    // e_dx and e_dy are the changes in the edge functions for a one pixel step
+    int32_t e_dx[3], e_dy[3];
+    for (int i = 0; i < 3; i++) {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        e_dx[i] = (py[b] - py[a]) << FIXED_SUBPIXEL_BITS;
+        e_dy[i] = (px[a] - px[b]) << FIXED_SUBPIXEL_BITS;
+    }
+    int64_t area = (int64_t)(px[2] - px[0]) * (py[1] - py[0]) - (int64_t)(py[2] - py[0]) * (px[1] - px[0]);
+    if (area == 0)
+        return 0;
+
+    // Make the inside of the triangle positive whichever way it winds
+    int sign = area < 0 ? -1 : 1;
+    if (area < 0) {
+        area = -area;
+        for (int i = 0; i < 3; i++) {
+            e_dx[i] = -e_dx[i];
+            e_dy[i] = -e_dy[i];
+        }
+    }
 
-                if (depth_check(r->z_buffer, scrX + scrY * scrSize.x, -inv_z)) {
-                    continue;
-                }
+    // 1/area as a 31 bit mantissa, so that e * FIXED_ATTR_ONE / area = (e * recip) >> recip_shift
+    uint64_t recip = ((uint64_t)1 << 62) / (uint64_t)area;
+    int recip_shift = 32;
+    while (recip >= ((uint64_t)1 << 31)) {
+        recip >>= 1;
+        recip_shift--;
+    }
 
-                depth_write(r->z_buffer, scrX + scrY * scrSize.x, -inv_z);
+    // Steps in the barycentric weights of vertices 1 and 2
+    int64_t b_dx[2], b_dy[2];
+    for (int i = 0; i < 2; i++) {
+        b_dx[i] = ((int64_t)e_dx[i + 1] * (int64_t)recip) >> recip_shift;
+        b_dy[i] = ((int64_t)e_dy[i + 1] * (int64_t)recip) >> recip_shift;
+        // triangles thinner than a pixel change the weights too quickly to step in 2.30
+        if (b_dx[i] >= FIXED_ATTR_ONE || b_dx[i] <= -FIXED_ATTR_ONE ||
+            b_dy[i] >= FIXED_ATTR_ONE || b_dy[i] <= -FIXED_ATTR_ONE)
+            return -1;
+    }
 
-                Pixel color = {255};
-                if (texture) {
-                    // Interpolate the texture coordinates
-                    Vec2f uv;
-                    uv.x = (uv0->x * w0 + uv1->x * w1 + uv2->x * w2) * z;
-                    uv.y = (uv0->y * w0 + uv1->y * w1 + uv2->y * w2) * z;
+    // Each attribute is its value at vertex 0 plus steps in x and y
+    int32_t attr[3][3];
+    int32_t attr_dx[3], attr_dy[3];
+    for (int i = 0; i < 3; i++) {
+        attr[0][i] = to_fixed(d[i], FIXED_ATTR_BITS);
+        attr[1][i] = to_fixed(uz[i], FIXED_ATTR_BITS);
+        attr[2][i] = to_fixed(vz[i], FIXED_ATTR_BITS);
+    }
+    for (int a = 0; a < 3; a++) {
+        int64_t delta1 = attr[a][1] - attr[a][0];
+        int64_t delta2 = attr[a][2] - attr[a][0];
+        attr_dx[a] = (int32_t)((delta1 * b_dx[0] + delta2 * b_dx[1]) >> FIXED_ATTR_BITS);
+        attr_dy[a] = (int32_t)((delta1 * b_dy[0] + delta2 * b_dy[1]) >> FIXED_ATTR_BITS);
+    }
 
-                    // Shade the pixel and update the color buffer
-                    color = shade(texture, uv);
-                }
+    int32_t near_fixed = near >= 2 ? INT32_MAX : to_fixed(near, FIXED_ATTR_BITS);
+    int textured = texture && texture->pixels;
+    const PingoDepth z_buffer = r->z_buffer;
+    uint32_t pixels = 0;
 
-                backendDrawPixel(r, &r->frameBuffer, (Vec2i) { scrX, scrY }, color, diffuseLight);
+    for (int scrY = y0; scrY <= y1; ++scrY) {
+        int32_t sample_x = x0 << FIXED_SUBPIXEL_BITS;
+        int32_t sample_y = scrY << FIXED_SUBPIXEL_BITS;
+
+        // Narrow the row to the pixels where all three edge functions are non-negative
+        int32_t span_start = 0;
+        int32_t span_end = x1 - x0;
+        for (int i = 0; i < 3 && span_start <= span_end; i++) {
+            int a = (i + 1) % 3;
+            int b = (i + 2) % 3;
+            int32_t e = sign * (int32_t)((int64_t)(sample_x - px[a]) * (py[b] - py[a]) - (int64_t)(sample_y - py[a]) * (px[b] - px[a]));
+            if (e_dx[i] > 0) {
+                span_start = MAX(span_start, ceil_steps(e, e_dx[i]));
+            } else if (e_dx[i] < 0) {
+                span_end = MIN(span_end, floor_steps(e, e_dx[i]));
+            } else if (e < 0) {
+                span_end = -1;
             }
         }
+        if (span_start > span_end)
+            continue;
+
+        int x_start = x0 + span_start;
+        int x_end = x0 + span_end;
+
+        // Attributes at the start of the span, relative to vertex 0
+        int64_t offset_x = ((int64_t)x_start << FIXED_SUBPIXEL_BITS) - px[0];
+        int64_t offset_y = (int64_t)sample_y - py[0];
+        int32_t attr_start[3];
+        for (int a = 0; a < 3; a++) {
+            attr_start[a] = attr[a][0] + (int32_t)((attr_dx[a] * offset_x + attr_dy[a] * offset_y) >> FIXED_SUBPIXEL_BITS);
+        }
+        int32_t inv_z = attr_start[0];
+        int32_t u = attr_start[1];
+        int32_t v = attr_start[2];
+
+        for (int scrX = x_start, index = scrY * scrSize.x + x_start; scrX <= x_end; ++scrX, ++index,
+                inv_z += attr_dx[0], u += attr_dx[1], v += attr_dx[2]) {
+            if (inv_z > near_fixed || inv_z <= 0) {
+                continue;
+            }
+
+            // Depth as a fraction of the full range
+            uint32_t depth = depth_value_fixed(&z_buffer, inv_z >= FIXED_ATTR_ONE ? UINT32_MAX : (uint32_t)inv_z << (32 - FIXED_ATTR_BITS));
+            if (depth_check(&z_buffer, index, depth)) {
+                continue;
+            }
+
+            depth_write(&z_buffer, index, depth);
+
+            Pixel color = {255};
+            if (textured) {
+                color = shade_fixed(texture, u, v, inv_z);
+            }
+
+            backendDrawPixel(r, &r->frameBuffer, (Vec2i) { scrX, scrY }, color, diffuseLight);
+            pixels++;
+        }
     }
+
+    return pixels;
 }
 
 float isClockWise(float x1, float y1, float x2, float y2, float x3, float y3) {
@@ -327,6 +809,11 @@ void backendDrawPixel (Renderer * r, Texture * f, Vec2i pos, Pixel color, float
         // Draw using the backend
         r->backEnd->drawPixel(f, pos, color, illumination);
     }
+    else if (r->target.rows) {
+        // Straight onto the display, in its own format
+        const RenderTarget * target = &r->target;
+        target->rows[pos.y][(target->x + pos.x) ^ target->swizzle] = target->native[color.c];
+    }
     else {
         // By default call this
         // texture_draw(f, pos, pixelMul(color,illumination));
@@ -361,6 +848,36 @@ static inline float edge(const Vec3f* const a, const Vec3f* const b, const Vec3f
     return (test->x - a->x) * (b->y - a->y) - (test->y - a->y) * (b->x - a->x);
 }
 
+// Perspective correct texture lookup from fixed point u/z, v/z and 1/z
+static Pixel shade_fixed(const Texture* texture, int32_t u, int32_t v, int32_t inv_z) {
+    // 1/z to 16 bits of precision with a single 32 bit division
+    // 1/inv_z = recip >> (47 - shift), with inv_z and the result in 2.30
+    int shift = __builtin_clz((uint32_t)inv_z);
+    uint32_t recip = 0x80000000u / (((uint32_t)inv_z << shift) >> 16);
+    int recip_shift = 47 - shift;
+
+    Vec2i texel;
+    texel.x = (int)(((int64_t)u * recip * texture->size.x) >> recip_shift);
+    texel.y = (int)(((int64_t)v * recip * texture->size.y) >> recip_shift);
+    texel.x = MAX(0, MIN(texel.x, texture->size.x - 1));
+    texel.y = MAX(0, MIN(texel.y, texture->size.y - 1));
+
+    return texture_read(texture, texel);
+}
+
+// Narrow a span of x steps from the row start to where a weight is non-negative
+// Returns 0 if the weight is negative along the whole row
+static inline int span_limit(float w_row, float w_dx, float* const span_start, float* const span_end) {
+    if (w_dx > 0) {
+        *span_start = MAX(*span_start, -w_row / w_dx);
+    } else if (w_dx < 0) {
+        *span_end = MIN(*span_end, -w_row / w_dx);
+    } else if (w_row < 0) {
+        return 0;
+    }
+    return *span_start <= *span_end + 1;
+}
+
 static Pixel shade(const Texture* texture, Vec2f uv) {
     if (texture->pixels != NULL) {
         float u = uv.x;
@@ -375,46 +892,3 @@ static Pixel shade(const Texture* texture, Vec2f uv) {
         return texture_read(texture, texel);
     }
 }
-
-// NOT SCRATCHPIXEL BUT NOT PINGO EITHER
-// Helper function to find intersection of a line segment with the screen bounds
-static inline int clip_edge(float y, const Vec3f* const v0, const Vec3f* const v1, Vec2f* out) {
-    // Check if the edge is horizontal (skip as no intersection along the scanline)
-    if (v0->y == v1->y) return 0;
-
-    // Calculate intersection x-coordinate of the line segment with the horizontal line y
-    float t = (y - v0->y) / (v1->y - v0->y);
-    if (t < 0 || t > 1) return 0; // Intersection not within the segment
-
-    out->x = v0->x + t * (v1->x - v0->x);
-    out->y = y;
-    return 1; // Valid intersection found
-}
-
-// Function to find scanline intersections for triangle edges
-static void find_scanline_intersections(const Vec3f* p0, const Vec3f* p1, const Vec3f* p2, int scanline_y, Vec2f* out_intersections, int* count) {
-    // Initialize intersection count
-    *count = 0;
-    
-    // Check intersection with the first edge (p0-p1)
-    if (clip_edge((float)scanline_y, p0, p1, &out_intersections[*count])) {
-        (*count)++;
-    }
-
-    // Check intersection with the second edge (p1-p2)
-    if (clip_edge((float)scanline_y, p1, p2, &out_intersections[*count])) {
-        (*count)++;
-    }
-
-    // Check intersection with the third edge (p2-p0)
-    if (*count < 2 && clip_edge((float)scanline_y, p2, p0, &out_intersections[*count])) {
-        (*count)++;
-    }
-
-    // Sort intersections by x-coordinate if two valid intersections are found
-    if (*count == 2 && out_intersections[0].x > out_intersections[1].x) {
-        Vec2f temp = out_intersections[0];
-        out_intersections[0] = out_intersections[1];
-        out_intersections[1] = temp;
-    }
-}
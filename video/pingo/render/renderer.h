@@ -6,6 +6,7 @@
 #include "renderable.h"
 #include "pixel.h"
 #include "camera.h"
+#include "mesh.h"
 
 typedef struct tag_Scene Scene;
 typedef struct tag_BackEnd BackEnd;
@@ -16,11 +17,57 @@ typedef enum {
     REND_BACKGROUND = 2 // 2: Clear with a background texture
 } RenderClearType;
 
+typedef struct RenderStats {
+    uint32_t pixels;            // Pixels that passed the depth test in the last frame
+    uint32_t objects_drawn;     // Objects at least partly inside the view
+    uint32_t objects_culled;    // Objects skipped as their bounding sphere is outside the view
+} RenderStats;
+
+// A rectangle of pixels from x0, y0 up to but not including x1, y1
+typedef struct RenderRect {
+    int x0, y0, x1, y1;
+} RenderRect;
+
+// A display the frame is drawn straight into, in the display's own pixel format
+typedef struct RenderTarget {
+    uint8_t ** rows;            // Start of the display row under each row of the frame, or NULL to draw into the frame buffer
+    int x;                      // Display column under the left edge of the frame
+    int swizzle;                // XORed with each display column, for displays that store pixels out of order
+    int double_buffered;        // Set if the display alternates between two buffers, so each holds the frame before last
+    RenderRect drawn_before;    // Bounding box of everything drawn in the frame before last
+    uint8_t native[256];        // Display value for each Pixel value
+} RenderTarget;
+
+// A triangle in raster space, ready to be rasterized
+typedef struct RasterTriangle {
+    Vec3f a, b, c;
+    Vec2f uva, uvb, uvc;        // Texture coordinates divided by z
+    float bbox[4];              // Bounding box
+    int x0, y0, x1, y1;         // Bounding box clipped to the frame
+    const Texture * texture;
+    float near;
+    float light;
+} RasterTriangle;
+
+// Triangles binned into tiles, for rendering the tiles in parallel
+typedef struct RenderTiles {
+    int collecting;             // Set while triangles are being set up for the tiles
+    int overflow;               // Set if the scene couldn't be set up for tiles
+    RasterTriangle * triangles;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t * bins;            // Triangle indexes for each tile, in the order they were set up
+    uint32_t bins_capacity;
+    uint32_t * bin_starts;      // Start of each tile's triangle indexes, and the end of the last
+    uint32_t * tile_pixels;     // Pixels drawn in each tile
+    int tile_count;
+} RenderTiles;
+
 typedef struct Renderer{
     Camera camera;
     Scene * scene;
 
-    PingoDepth * z_buffer;
+    PingoDepth z_buffer;
 
     Texture frameBuffer;
     
@@ -30,10 +77,32 @@ typedef struct Renderer{
 
     BackEnd * backEnd;
 
+    RenderStats stats;
+
+    RenderRect drawn;   // Bounding box of everything drawn in the current frame
+    RenderRect dirty;   // Bounding box of everything drawn in the last frame, which is all that needs clearing
+    RenderRect clip;    // Part of the frame that can be drawn, with everything outside it left untouched
+
+    RenderTarget target;
+
+    Vec3f * vertices;   // Device coordinates of the positions of the object being rendered
+    uint32_t vertices_capacity;
+
+    int fixed_point;    // Rasterize in fixed point rather than float where possible
+
+    int tiled;          // Rasterize in tiles, using the backend to share them between cores
+    RenderTiles tiles;
+
 } Renderer;
 
 extern int rendererRender(Renderer *);
 
+// Clear the whole frame buffer for the next frame, after something other than the renderer changed it
+extern void rendererInvalidate(Renderer *);
+
+// Only draw inside the rectangle of the frame, which is the whole frame unless set
+extern void rendererSetClip(Renderer *, RenderRect clip);
+
 extern int rendererInit(Renderer *, Vec2i size, BackEnd * backEnd);
 
 extern int rendererSetScene(Renderer *r, Scene *s);
@@ -54,16 +123,4 @@ float isClockWise(float x1, float y1, float x2, float y2, float x3, float y3);
 
 int orient2d( Vec2i a,  Vec2i b,  Vec2i c);
 
-void backendDrawPixel (Renderer * r, Texture * f, Vec2i pos, Pixel color, float illumination);
-
-
-// SCRATCHPIXEL FUNCTIONS
-// https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/perspective-correct-interpolation-vertex-attributes.html
-static inline void persp_divide(struct Vec3f* p);
-static inline void to_raster(const Vec2i size, struct Vec3f* const p);
-static inline void tri_bbox(const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, float* const bbox);
-static inline float edge(const Vec3f* const a, const Vec3f* const b, const Vec3f* const test);
-static Pixel shade(const Texture* texture, Vec2f uv);
-static inline void rasterize(int x0, int y0, int x1, int y1, const Vec3f* const p0, const Vec3f* const p1, const Vec3f* const p2, const Vec2f* const uv0, const Vec2f* const uv1, const Vec2f* const uv2, const Texture* const texture, const Vec2i scrSize, Renderer* r, float near, float diffuseLight);
-static inline int clip_edge(float y, const Vec3f* const v0, const Vec3f* const v1, Vec2f* out);
-static void find_scanline_intersections(const Vec3f* p0, const Vec3f* p1, const Vec3f* p2, int scanline_y, Vec2f* out_intersections, int* count);
\ No newline at end of file
+void backendDrawPixel (Renderer * r, Texture * f, Vec2i pos, Pixel color, float illumination);
\ No newline at end of file
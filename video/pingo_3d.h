@@ -6,6 +6,7 @@
 #include <agon.h>
 #include <map>
 #include "esp_heap_caps.h"
+#include "parallel.h"
 #include "sprites.h"
 #include "vdu_stream_processor.h"
 
@@ -29,6 +30,11 @@ namespace p3d {
 
 #define PINGO_3D_CONTROL_TAG    0x43443350 // "P3DC"
 
+// Formats of values in buffers holding mesh data
+#define PINGO_FORMAT_FIXED16    0   // 16 bit fixed point, scaled as in the commands that take values directly
+#define PINGO_FORMAT_FLOAT16    1   // IEEE half precision floating point
+#define PINGO_FORMAT_FLOAT32    2   // IEEE single precision floating point, as used by the renderer
+
 #define PI2                    6.283185307179586476925286766559f
 
 class VDUStreamProcessor;typedef struct tag_Transformable {
@@ -229,6 +235,7 @@ struct tag_Pingo3dControl;
 
 extern "C" {
     p3d::Pixel* static_get_frame_buffer(p3d::Renderer* ren, p3d::BackEnd* backEnd);
+    void static_run_jobs(int count, void (*job)(void* data, int index), void* data);
 } // extern "C"
 
 typedef struct tag_Pingo3dControl {
@@ -245,7 +252,15 @@ typedef struct tag_Pingo3dControl {
     Transformable       m_scene;            // Scene transformation settings
     std::map<uint16_t, p3d::Mesh>* m_meshes;    // Map of meshes for use by objects
     std::map<uint16_t, TexObject>* m_objects;   // Map of textured objects that use meshes and have transforms
+    std::multimap<const void*, std::shared_ptr<BufferStream>>* m_adopted; // Buffers whose data is used in place by meshes and objects
     uint8_t             m_dither_type;      // Dithering type and options to be applied to rendered bitmap
+    bool                m_on_screen;        // The last frame was rendered straight onto the screen
+    int                 m_screen_x;         // Screen position of the last frame rendered onto the screen
+    int                 m_screen_y;
+    uint8_t             m_screen_mode;      // Screen mode the last frame was rendered onto
+    uint8_t**           m_screen_rows;      // Screen row under each row of the frame
+    const void*         m_background;       // Background pixels restored in the last frame, or NULL if it was cleared
+    uint32_t            m_background_writes; // Write count of the buffer block holding those pixels
 
     void show_free_ram() {
         debug_log("Free PSRAM: %u\n", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
@@ -293,10 +308,13 @@ typedef struct tag_Pingo3dControl {
 
         m_backend.getFrameBuffer = &static_get_frame_buffer;
         m_backend.drawPixel = NULL;
+        m_backend.runJobs = &static_run_jobs;
         m_backend.clientCustomData = (void*) this;
+        m_renderer.tiled = 1;
 
         m_meshes = new std::map<uint16_t, p3d::Mesh>;
         m_objects = new std::map<uint16_t, TexObject>;
+        m_adopted = new std::multimap<const void*, std::shared_ptr<BufferStream>>;
 
         printf("Pingo3dControl initialized\n");
     }
@@ -310,12 +328,140 @@ typedef struct tag_Pingo3dControl {
 
         auto start = millis();
 
-        auto frame_dims = p3d::Vec2i{(int)m_width, (int)m_height};
+        render_to_frame_buffer();
+
+        // Apply dithering to the rendered image before copying to the destination bitmap
+        switch (m_dither_type) {
+            case 0:
+                break; // no dithering applied
+            case 1:
+                dither_bayer((uint8_t*)m_renderer.frameBuffer.pixels, m_width, m_height);
+                break;
+            case 2:
+                dither_floyd_steinberg((uint8_t*)m_renderer.frameBuffer.pixels, m_width, m_height);
+                break;
+            default:
+                m_dither_type = 0; // no dithering applied
+                debug_log("Invalid dithering type %u\n", m_dither_type);
+                break;
+        }
+        if (m_dither_type) {
+            // dithering changed the whole frame, not just the parts the renderer drew
+            p3d::rendererInvalidate(&m_renderer);
+        }
+
+        show_render_stats(start);
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 46, x; y; :  Render To Screen
+    void render_to_screen() {
+        auto x = m_proc->readWord_t();
+        if (x < 0) {
+            return;
+        }
+        auto y = m_proc->readWord_t();
+        if (y < 0) {
+            return;
+        }
+
+        auto start = millis();
+
+        // Drawing already queued must be done before the screen is written to directly
+        waitPlotCompletion();
+
+        if (getVGAColourDepth() != 64) {
+            // Paletted modes pack several pixels into each byte, so the frame is drawn from the frame buffer
+            render_to_frame_buffer();
+            canvas->drawBitmap((int16_t) x, (int16_t) y, getBitmap(257).get());
+            waitPlotCompletion();
+        } else if (render_onto_screen((int16_t) x, (int16_t) y)) {
+            return;
+        }
+        if (isDoubleBuffered()) {
+            switchBuffer();
+        }
+
+        show_render_stats(start);
+    }
+
+    // Render into the frame buffer, which holds the last frame unless it was rendered onto the screen
+    void render_to_frame_buffer() {
+        if (m_on_screen) {
+            m_on_screen = false;
+            m_renderer.target.rows = NULL;
+            p3d::rendererSetClip(&m_renderer, p3d::RenderRect{0, 0, (int)m_width, (int)m_height});
+            p3d::rendererInvalidate(&m_renderer);
+        }
+        render_scene();
+    }
+
+    // Render straight into the screen buffer being drawn, which is the one not on show when double buffered,
+    // with the top left of the frame at x, y and only the part inside the graphics viewport drawn
+    // Returns true if there is nothing to draw
+    bool render_onto_screen(int x, int y) {
+        if (!m_screen_rows) {
+            m_screen_rows = (uint8_t**) heap_caps_malloc(m_height * sizeof(uint8_t*), MALLOC_CAP_SPIRAM);
+            if (!m_screen_rows) {
+                debug_log("render_to_screen: failed to allocate screen rows\n");
+                return true;
+            }
+        }
+
+        // Anything already on the screen under the frame is unknown, so it is all cleared
+        auto double_buffered = isDoubleBuffered();
+        if (!m_on_screen || x != m_screen_x || y != m_screen_y || videoMode != m_screen_mode ||
+                double_buffered != (bool) m_renderer.target.double_buffered) {
+            m_on_screen = true;
+            m_screen_x = x;
+            m_screen_y = y;
+            m_screen_mode = videoMode;
+            m_renderer.target.double_buffered = double_buffered;
+            p3d::rendererInvalidate(&m_renderer);
+        }
+
+        auto viewport = m_proc->getContext()->getGraphicsViewport();
+        auto clip = p3d::RenderRect{
+            std::max((int)viewport.X1, 0) - x,
+            std::max((int)viewport.Y1, 0) - y,
+            std::min((int)viewport.X2 + 1, (int)canvasW) - x,
+            std::min((int)viewport.Y2 + 1, (int)canvasH) - y
+        };
+        p3d::rendererSetClip(&m_renderer, clip);
+        clip = m_renderer.clip;
+        if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1) {
+            return true;
+        }
+
+        // The 64 colour controller holds a byte per pixel, with its sync signals in the top bits,
+        // and stores each group of 4 pixels in a 32 bit word in the order 2, 3, 0, 1
+        auto controller = static_cast<fabgl::VGAController*>(_VGAController.get());
+        for (int c = 0; c < 256; c++) {
+            m_renderer.target.native[c] = controller->createRawPixel(RGB222(c & 3, (c >> 2) & 3, (c >> 4) & 3));
+        }
+        for (int row = clip.y0; row < clip.y1; row++) {
+            m_screen_rows[row] = (uint8_t*) controller->getScanline(y + row);
+        }
+        m_renderer.target.rows = m_screen_rows;
+        m_renderer.target.x = x;
+        m_renderer.target.swizzle = 2;
 
+        render_scene();
+        return false;
+    }
+
+    void render_scene() {
         p3d::Scene scene;
         sceneInit(&scene);
         p3d::rendererSetScene(&m_renderer, &scene);
 
+        // Positions used in place from a buffer can be changed through the buffer at any time,
+        // so the bounds used for culling are worked out again for each frame
+        for (auto mesh = m_meshes->begin(); mesh != m_meshes->end(); mesh++) {
+            if (mesh->second.positions && m_adopted->count(mesh->second.positions)) {
+                p3d::meshComputeBounds(&mesh->second);
+            }
+        }
+
         for (auto object = m_objects->begin(); object != m_objects->end(); object++) {
             object->second.bind();
             if (object->second.m_modified) {
@@ -359,28 +505,57 @@ typedef struct tag_Pingo3dControl {
         //debug_log("Frame data:  %02hX %02hX %02hX %02hX\n", m_frame->r, m_frame->g, m_frame->b, m_frame->a);
         //debug_log("Destination: %02hX %02hX %02hX %02hX\n", dst_pix->r, dst_pix->g, dst_pix->b, dst_pix->a);
 
+        // The background bitmap can be replaced or written to between frames, and then all of it
+        // is restored, rather than just what the last frame drew over
+        auto clear = m_renderer.clear;
+        if (clear == p3d::REND_BACKGROUND) {
+            auto bkgbmp = getBitmap(258).get();
+            const void* background = NULL;
+            uint32_t writes = 0;
+            if (bkgbmp && bkgbmp->width == m_width && bkgbmp->height == m_height) {
+                background = bkgbmp->data;
+                writes = get_background_writes(background);
+                m_renderer.background.pixels = (p3d::Pixel*) background;
+            } else {
+                // clear this frame instead, keeping the setting for when the bitmap is back
+                m_renderer.clear = p3d::REND_CLEAR;
+            }
+            if (background != m_background || writes != m_background_writes) {
+                if (!background) {
+                    debug_log("render_scene: background bitmap 258 is missing or the wrong size, so clearing instead\n");
+                }
+                m_background = background;
+                m_background_writes = writes;
+                p3d::rendererInvalidate(&m_renderer);
+            }
+        }
+
         rendererRender(&m_renderer);
+        m_renderer.clear = clear;
+    }
 
-        // Apply dithering to the rendered image before copying to the destination bitmap
-        switch (m_dither_type) {
-            case 0:
-                break; // no dithering applied
-            case 1:
-                dither_bayer((uint8_t*)m_renderer.frameBuffer.pixels, m_width, m_height);
-                break;
-            case 2:
-                dither_floyd_steinberg((uint8_t*)m_renderer.frameBuffer.pixels, m_width, m_height);
-                break;
-            default:
-                m_dither_type = 0; // no dithering applied
-                debug_log("Invalid dithering type %u\n", m_dither_type);
-                break;
+    // Write count of the block of buffer 258 holding the background's pixels, which changes
+    // when the buffer is written to, or 0 if the pixels aren't held in the buffer
+    uint32_t get_background_writes(const void* data) {
+        auto bufferIter = buffers.find(258);
+        if (bufferIter != buffers.end()) {
+            for (const auto &block : bufferIter->second) {
+                if (block->getBuffer() == data) {
+                    return block->writeCount();
+                }
+            }
         }
+        return 0;
+    }
 
+    void show_render_stats(uint32_t start) {
         auto stop = millis();
         auto diff = stop - start;
         float fps = 1000.0 / diff;
-        printf("Render to %ux%u took %u ms (%.2f FPS)\n", m_width, m_height, diff, fps);
+        auto pixels = m_renderer.stats.pixels;
+        printf("Render to %ux%u took %u ms (%.2f FPS), %u pixels drawn (%.0f pixels/s), %u objects drawn, %u culled\n",
+            m_width, m_height, diff, fps, pixels, diff ? pixels * 1000.0f / diff : 0.0f,
+            m_renderer.stats.objects_drawn, m_renderer.stats.objects_culled);
     }
 
     // VDU 23, 0, &A0, sid; &49, 0, 0 :  Deinitialize Control Structure
@@ -449,6 +624,14 @@ typedef struct tag_Pingo3dControl {
 
             case 38: render_to_bitmap(); break;
             case 41: set_rendering_dither_type(); break;
+            case 43: set_rendering_fixed_point(); break;
+            case 44: set_rendering_tiled(); break;
+            case 45: set_depth_buffer_format(); break;
+            case 46: render_to_screen(); break;
+            case 47: define_mesh_vertices_from_buffer(); break;
+            case 48: set_mesh_vertex_indexes_from_buffer(); break;
+            case 49: define_object_texture_coordinates_from_buffer(); break;
+            case 50: set_object_texture_coordinate_indexes_from_buffer(); break;
         }
     }
 
@@ -494,12 +677,89 @@ typedef struct tag_Pingo3dControl {
         return NULL;
     }
 
+    // Free the data of a mesh or object, or let go of the buffer it is used in place from,
+    // which may be used in place elsewhere too
+    void release_data(void* data) {
+        auto adopted = m_adopted->find(data);
+        if (adopted != m_adopted->end()) {
+            m_adopted->erase(adopted);
+        } else {
+            heap_caps_free(data);
+        }
+    }
+
+    // Get a buffer's data as a single block
+    std::shared_ptr<BufferStream> get_buffer_stream(int32_t bufferId) {
+        if (bufferId < 0) {
+            return nullptr;
+        }
+        auto bufferIter = buffers.find(bufferId);
+        if (bufferIter == buffers.end() || bufferIter->second.empty()) {
+            debug_log("get_buffer_stream: buffer %d not found\n", bufferId);
+            return nullptr;
+        }
+        return consolidateBuffers(bufferIter->second);
+    }
+
+    // Size in bytes of each value in a buffer format, or 0 if the format is unknown
+    uint32_t get_format_size(int32_t format) {
+        switch (format) {
+            case PINGO_FORMAT_FIXED16: return 2;
+            case PINGO_FORMAT_FLOAT16: return 2;
+            case PINGO_FORMAT_FLOAT32: return 4;
+        }
+        return 0;
+    }
+
+    // Value i of a buffer, with 16 bit fixed point values converted by convert_fixed
+    template <typename F>
+    float get_buffer_value(const uint8_t* data, uint32_t i, int32_t format, F convert_fixed) {
+        if (format == PINGO_FORMAT_FLOAT32) {
+            float value;
+            memcpy(&value, data + i * sizeof(float), sizeof(float));
+            return value;
+        }
+        uint16_t value;
+        memcpy(&value, data + i * sizeof(uint16_t), sizeof(uint16_t));
+        if (format == PINGO_FORMAT_FLOAT16) {
+            return float16ToFloat32(value);
+        }
+        return convert_fixed(value);
+    }
+
+    // Get count values of type T from a buffer, using the buffer's data in place if it is already in
+    // the renderer's format, or else converting each value with convert(data, i) into a new array
+    template <typename T, typename F>
+    T* adopt_or_convert(std::shared_ptr<BufferStream> stream, bool native, uint32_t count, F convert) {
+        if (native) {
+            // the mesh keeps a pointer to the buffer data, so it must stay put
+            auto data = stream->pin();
+            if (data && ((uintptr_t) data % alignof(T)) == 0) {
+                m_adopted->insert(std::make_pair(data, stream));
+                return (T*) data;
+            }
+        }
+        auto size = count * sizeof(T);
+        auto values = (T*) heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+        if (!values) {
+            debug_log("adopt_or_convert: failed to allocate %u bytes\n", size);
+            show_free_ram();
+            return NULL;
+        }
+        auto data = stream->getBuffer();
+        for (uint32_t i = 0; i < count; i++) {
+            values[i] = convert(data, i);
+        }
+        return values;
+    }
+
     // VDU 23, 0, &A0, sid; &49, 1, mid; n; x0; y0; z0; ... :  Define Mesh Vertices
     void define_mesh_vertices() {
         auto mesh = get_mesh();
         if (mesh->positions) {
-            heap_caps_free(mesh->positions);
+            release_data(mesh->positions);
             mesh->positions = NULL;
+            mesh->positions_count = 0;
         }
         auto n = (uint32_t) m_proc->readWord_t();
         if (n > 0) {
@@ -509,6 +769,8 @@ typedef struct tag_Pingo3dControl {
             if (!pos) {
                 debug_log("define_mesh_vertices: failed to allocate %u bytes\n", size);
                 show_free_ram();
+            } else {
+                mesh->positions_count = n;
             }
             debug_log("Reading %u vertices\n", n);
             for (uint32_t i = 0; i < n; i++) {
@@ -525,13 +787,14 @@ typedef struct tag_Pingo3dControl {
             }
             debug_log("\n");
         }
+        p3d::meshComputeBounds(mesh);
     }
 
     // VDU 23, 0, &A0, sid; &49, 2, mid; n; i0; ... :  Set Mesh Vertex Indexes
     void set_mesh_vertex_indexes() {
         auto mesh = get_mesh();
         if (mesh->pos_indices) {
-            heap_caps_free(mesh->pos_indices);
+            release_data(mesh->pos_indices);
             mesh->pos_indices = NULL;
             mesh->indexes_count = 0;
         }
@@ -561,7 +824,7 @@ typedef struct tag_Pingo3dControl {
     void define_object_texture_coordinates() {
         auto object = get_object();
         if (object->m_object.textCoord) {
-            heap_caps_free(object->m_object.textCoord);
+            release_data(object->m_object.textCoord);
             object->m_object.textCoord = NULL;
         }
         auto n = (uint32_t) m_proc->readWord_t();
@@ -591,7 +854,7 @@ typedef struct tag_Pingo3dControl {
     void set_object_texture_coordinate_indexes() {
         auto object = get_object();
         if (object->m_object.tex_indices) {
-            heap_caps_free(object->m_object.tex_indices);
+            release_data(object->m_object.tex_indices);
             object->m_object.tex_indices = NULL;
         }
         auto n = (uint32_t) m_proc->readWord_t();
@@ -618,6 +881,121 @@ typedef struct tag_Pingo3dControl {
         }
     }
 
+    // VDU 23, 0, &A0, sid; &49, 47, mid; bufid; format :  Define Mesh Vertices From Buffer
+    void define_mesh_vertices_from_buffer() {
+        auto mesh = get_mesh();
+        auto stream = get_buffer_stream(m_proc->readWord_t());
+        auto format = m_proc->readByte_t();
+        auto value_size = get_format_size(format);
+        if (!mesh || !stream || !value_size) {
+            debug_log("define_mesh_vertices_from_buffer: invalid mesh, buffer or format %d\n", format);
+            return;
+        }
+        if (mesh->positions) {
+            release_data(mesh->positions);
+            mesh->positions = NULL;
+            mesh->positions_count = 0;
+        }
+        auto n = stream->size() / (3 * value_size);
+        if (n > 0) {
+            auto convert_fixed = [this](uint16_t value) { return convert_position_value(value); };
+            mesh->positions = adopt_or_convert<p3d::Vec3f>(stream, format == PINGO_FORMAT_FLOAT32, n,
+                [&](const uint8_t* data, uint32_t i) {
+                    return p3d::Vec3f{
+                        get_buffer_value(data, i * 3 + 0, format, convert_fixed),
+                        get_buffer_value(data, i * 3 + 1, format, convert_fixed),
+                        get_buffer_value(data, i * 3 + 2, format, convert_fixed)
+                    };
+                });
+            if (mesh->positions) {
+                mesh->positions_count = n;
+            }
+            debug_log("Read %u vertices\n", n);
+        }
+        p3d::meshComputeBounds(mesh);
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 48, mid; bufid; :  Set Mesh Vertex Indexes From Buffer
+    void set_mesh_vertex_indexes_from_buffer() {
+        auto mesh = get_mesh();
+        auto stream = get_buffer_stream(m_proc->readWord_t());
+        if (!mesh || !stream) {
+            debug_log("set_mesh_vertex_indexes_from_buffer: invalid mesh or buffer\n");
+            return;
+        }
+        if (mesh->pos_indices) {
+            release_data(mesh->pos_indices);
+            mesh->pos_indices = NULL;
+            mesh->indexes_count = 0;
+        }
+        auto n = stream->size() / sizeof(uint16_t);
+        if (n > 0) {
+            mesh->pos_indices = adopt_or_convert<uint16_t>(stream, true, n,
+                [](const uint8_t* data, uint32_t i) {
+                    uint16_t index;
+                    memcpy(&index, data + i * sizeof(uint16_t), sizeof(uint16_t));
+                    return index;
+                });
+            if (mesh->pos_indices) {
+                mesh->indexes_count = n;
+            }
+            debug_log("Read %u vertex indexes\n", n);
+        }
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 49, oid; bufid; format :  Define Object Texture Coordinates From Buffer
+    void define_object_texture_coordinates_from_buffer() {
+        auto object = get_object();
+        auto stream = get_buffer_stream(m_proc->readWord_t());
+        auto format = m_proc->readByte_t();
+        auto value_size = get_format_size(format);
+        if (!object || !stream || !value_size) {
+            debug_log("define_object_texture_coordinates_from_buffer: invalid object, buffer or format %d\n", format);
+            return;
+        }
+        if (object->m_object.textCoord) {
+            release_data(object->m_object.textCoord);
+            object->m_object.textCoord = NULL;
+        }
+        auto n = stream->size() / (2 * value_size);
+        if (n > 0) {
+            // fixed point coordinates are flipped as they are by Define Object Texture Coordinates,
+            // but floating point ones are taken as they are, so they can be used in place
+            auto convert_fixed = [this](uint16_t value) { return convert_texture_coordinate_value(value); };
+            object->m_object.textCoord = adopt_or_convert<p3d::Vec2f>(stream, format == PINGO_FORMAT_FLOAT32, n,
+                [&](const uint8_t* data, uint32_t i) {
+                    auto u = get_buffer_value(data, i * 2 + 0, format, convert_fixed);
+                    auto v = get_buffer_value(data, i * 2 + 1, format, convert_fixed);
+                    return p3d::Vec2f{u, format == PINGO_FORMAT_FIXED16 ? 1 - v : v};
+                });
+            debug_log("Read %u texture coordinates\n", n);
+        }
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 50, oid; bufid; :  Set Object Texture Coordinate Indexes From Buffer
+    void set_object_texture_coordinate_indexes_from_buffer() {
+        auto object = get_object();
+        auto stream = get_buffer_stream(m_proc->readWord_t());
+        if (!object || !stream) {
+            debug_log("set_object_texture_coordinate_indexes_from_buffer: invalid object or buffer\n");
+            return;
+        }
+        if (object->m_object.tex_indices) {
+            release_data(object->m_object.tex_indices);
+            object->m_object.tex_indices = NULL;
+        }
+        auto n = stream->size() / sizeof(uint16_t);
+        if (n > 0) {
+            object->m_object.tex_indices = adopt_or_convert<uint16_t>(stream, true, n,
+                [](const uint8_t* data, uint32_t i) {
+                    uint16_t index;
+                    memcpy(&index, data + i * sizeof(uint16_t), sizeof(uint16_t));
+                    return index;
+                });
+            debug_log("Read %u texture coordinate indexes\n", n);
+        }
+    }
+
     // VDU 23, 0, &A0, sid; &49, 5, oid; mid; bmid; :  Create Object
     void create_object() {
         auto object = get_object();
@@ -1099,6 +1477,32 @@ typedef struct tag_Pingo3dControl {
         }
     }
 
+    // VDU 23, 0, &A0, sid; &49, 43, enable : Set Rendering Fixed Point
+    void set_rendering_fixed_point() {
+        auto enable = m_proc->readByte_t();
+        m_renderer.fixed_point = enable == 1;
+        debug_log("Fixed point rendering %s\n", m_renderer.fixed_point ? "enabled" : "disabled");
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 44, enable : Set Rendering Tiled
+    void set_rendering_tiled() {
+        auto enable = m_proc->readByte_t();
+        m_renderer.tiled = enable == 1;
+        debug_log("Tiled rendering on both cores %s\n", m_renderer.tiled ? "enabled" : "disabled");
+    }
+
+    // VDU 23, 0, &A0, sid; &49, 45, bits, epochbits : Set Depth Buffer Format
+    void set_depth_buffer_format() {
+        auto bits = m_proc->readByte_t();
+        auto epoch_bits = m_proc->readByte_t();
+        if ((bits != 16 && bits != 32) || epoch_bits < 0 || epoch_bits > 8) {
+            debug_log("set_depth_buffer_format: invalid format %d, %d\n", bits, epoch_bits);
+            return;
+        }
+        p3d::depth_set_format(&m_renderer.z_buffer, bits == 16 ? p3d::DEPTH_16 : p3d::DEPTH_32, epoch_bits);
+        debug_log("Depth buffer format %d bit, cleared every %d frames\n", bits, 1 << epoch_bits);
+    }
+
     void dither_bayer(uint8_t* rgba, int width, int height) {
         static const uint8_t bayer[4][4] = {
             { 15, 135,  45, 165},
@@ -1188,6 +1592,12 @@ extern "C" {
         return p_this->m_renderer.frameBuffer.pixels;
     }
 
+    void static_run_jobs(int count, void (*job)(void* data, int index), void* data) {
+        runOnBothCores(count, [job, data](uint32_t index) {
+            job(data, index);
+        });
+    }
+
 #if DEBUG
     void show_pixel(float x, float y, uint8_t a, uint8_t b, uint8_t g, uint8_t r) {
         debug_log("%f %f %02hX %02hX %02hX %02hX\n", x, y, a, b, g, r);
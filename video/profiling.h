@@ -0,0 +1,122 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+// Command pipeline profiling
+//
+// When VDP_PROFILING is defined in agon.h the VDU stream processor counts
+// calls and inclusive execution time for every top-level VDU code,
+// every VDU 23, 0 command and every buffered command, along with the
+// number of bytes read from command streams and the number of allocations
+// made through PreferPSRAMAlloc.
+//
+// Statistics are reset and reported with VDU 23, 0, &F7, command
+//
+// When profiling is not enabled all of the hooks compile away to nothing.
+
+#include <stdint.h>
+#include <Arduino.h>
+
+#include "agon.h"
+
+#define PROFILE_VDU				0		// Top-level VDU codes
+#define PROFILE_VDP				1		// VDU 23, 0, n commands
+#define PROFILE_BUFFERED		2		// VDU 23, 0, &A0, bufferId; n commands
+#define PROFILE_TABLES			3
+
+#define PROFILE_RESET			0		// Reset all statistics
+#define PROFILE_REPORT			1		// Report statistics to the debug serial port
+
+#ifdef VDP_PROFILING
+
+struct ProfileCounter {
+	uint32_t	count;
+	uint64_t	time;					// Inclusive time in microseconds
+};
+
+struct VDUProfile {
+	ProfileCounter	counters[PROFILE_TABLES][256];
+	uint64_t		bytesRead;
+	uint64_t		receivedBytes;			// Bulk reads into buffers, through readIntoBuffer
+	uint64_t		receiveTime;
+	uint32_t		allocations;
+	uint64_t		allocatedBytes;
+	uint32_t		frees;
+	int64_t			startTime;
+};
+
+VDUProfile vduProfile = {};
+
+// Times a single command, from construction to the end of the enclosing scope
+// Nested commands (such as those run by a buffer call) are included in the time of their caller
+//
+class ProfileScope {
+	public:
+		ProfileScope(uint8_t table, int16_t opcode) :
+			counter(opcode >= 0 ? &vduProfile.counters[table][opcode & 0xFF] : nullptr), start(esp_timer_get_time()) {}
+		~ProfileScope() {
+			if (counter) {
+				counter->count++;
+				counter->time += esp_timer_get_time() - start;
+			}
+		}
+	private:
+		ProfileCounter *	counter;
+		int64_t				start;
+};
+
+#define PROFILE_SCOPE(table, opcode)	ProfileScope _profileScope((table), (opcode))
+#define PROFILE_BYTES(count)			(vduProfile.bytesRead += (count))
+#define PROFILE_RECEIVE(count, time)	(vduProfile.receivedBytes += (count), vduProfile.receiveTime += (time))
+#define PROFILE_ALLOC(size)				(vduProfile.allocations++, vduProfile.allocatedBytes += (size))
+#define PROFILE_FREE()					(vduProfile.frees++)
+
+inline void resetProfile() {
+	vduProfile = {};
+	vduProfile.startTime = esp_timer_get_time();
+}
+
+inline void reportProfileTable(const char * name, uint8_t table, float seconds) {
+	force_debug_log("%s:\n\r", name);
+	for (auto opcode = 0; opcode < 256; opcode++) {
+		auto &counter = vduProfile.counters[table][opcode];
+		if (counter.count == 0) {
+			continue;
+		}
+		force_debug_log("  &%02X: %u calls, %llu us total, %.2f us avg, %.1f calls/s\n\r",
+			opcode, counter.count, counter.time, (float)counter.time / counter.count, counter.count / seconds);
+	}
+}
+
+inline void reportProfile() {
+	auto elapsed = esp_timer_get_time() - vduProfile.startTime;
+	auto seconds = elapsed > 0 ? elapsed / 1000000.0f : 1.0f;
+	force_debug_log("Profile: %.3f s elapsed, %llu bytes read (%.0f bytes/s)\n\r",
+		seconds, vduProfile.bytesRead, vduProfile.bytesRead / seconds);
+	if (vduProfile.receiveTime > 0) {
+		force_debug_log("Bulk receives: %llu bytes in %llu us (%.0f bytes/s)\n\r",
+			vduProfile.receivedBytes, vduProfile.receiveTime, vduProfile.receivedBytes * 1000000.0f / vduProfile.receiveTime);
+	}
+	force_debug_log("Allocations: %u (%llu bytes), frees: %u\n\r",
+		vduProfile.allocations, vduProfile.allocatedBytes, vduProfile.frees);
+	reportProfileTable("VDU codes", PROFILE_VDU, seconds);
+	reportProfileTable("VDU 23, 0 commands", PROFILE_VDP, seconds);
+	reportProfileTable("Buffered commands", PROFILE_BUFFERED, seconds);
+}
+
+#else
+
+#define PROFILE_SCOPE(table, opcode)
+#define PROFILE_BYTES(count)
+#define PROFILE_RECEIVE(count, time)
+#define PROFILE_ALLOC(size)
+#define PROFILE_FREE()
+
+inline void resetProfile() {}
+
+inline void reportProfile() {
+	force_debug_log("Profiling not enabled - define VDP_PROFILING in agon.h\n\r");
+}
+
+#endif // VDP_PROFILING
+
+#endif // PROFILING_H
@@ -0,0 +1,253 @@
+#ifndef PSRAM_POOL_H
+#define PSRAM_POOL_H
+
+// Size-classed pool for small PSRAM allocations
+//
+// Buffer blocks, and the shared_ptr control blocks and vectors that keep track
+// of them, are mostly small and are created and freed constantly.  Left to the
+// heap they end up scattered through PSRAM, and over a long session the free
+// space breaks up until large allocations such as bitmaps or 3D frame buffers
+// can no longer be satisfied.
+//
+// Requests of up to PSRAM_POOL_MAX_SIZE bytes are instead served from fixed-size
+// slots, with one power-of-two size class per slot size.  Slots are carved from
+// pages of PSRAM_POOL_PAGE_SIZE bytes, aligned to their size so that the page a
+// slot belongs to can be found from its address.  Each page keeps its own free
+// list and count of slots in use, and each class keeps a list of its pages that
+// have free slots, so allocating and freeing a slot is just a pop or push, and
+// small allocations never interleave with large ones on the heap.
+//
+// Once all of a page's slots are free the page is returned to the heap, so memory
+// isn't held by one class after a burst of allocations.  Each class keeps one empty
+// page back, so a class that repeatedly allocates and frees a single slot doesn't
+// go to the heap every time.
+//
+// Slots carry no header, so the size of an allocation must be passed back in
+// when it is freed.  psram_allocator and make_unique_psram_array do this.
+//
+// Statistics for a class are returned with VDU 23, 0, &F6, index, or all are
+// written to the debug log with VDU 23, 0, &F6, &FF
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+
+#include "agon.h"
+#include "profiling.h"
+
+#define PSRAM_POOL_MIN_SHIFT	4		// Smallest slot is 16 bytes
+#define PSRAM_POOL_CLASSES		8		// Slot sizes 16, 32, 64 ... 2048 bytes
+#define PSRAM_POOL_MAX_SIZE		(1 << (PSRAM_POOL_MIN_SHIFT + PSRAM_POOL_CLASSES - 1))
+#define PSRAM_POOL_PAGE_SIZE	16384
+
+class PSRAMPool {
+	public:
+		struct Stats {
+			uint32_t	slotSize;
+			uint32_t	pages;
+			uint32_t	used;		// Slots in use
+			uint32_t	free;		// Free slots
+		};
+
+		static inline bool isPooled(size_t size) {
+			return size != 0 && size <= PSRAM_POOL_MAX_SIZE;
+		}
+
+		void * allocate(size_t size);
+		void deallocate(void * ptr, size_t size);
+		Stats getStats(uint8_t index);
+		void report();
+
+	private:
+		struct FreeSlot {
+			FreeSlot *	next;
+		};
+		// Held at the start of each page, in place of its first slots
+		struct Page {
+			Page *		prev;		// Neighbours on the class list of pages with free slots
+			Page *		next;
+			FreeSlot *	freeList;
+			uint16_t	used;
+			uint16_t	slots;
+		};
+		struct SizeClass {
+			Page *		partial;	// Pages with free slots
+			uint32_t	pages;
+			uint32_t	emptyPages;	// Pages with no slots in use, kept back for reuse
+			uint32_t	used;
+			uint32_t	free;
+		};
+
+		SizeClass		classes[PSRAM_POOL_CLASSES] = {};
+		portMUX_TYPE	lock = portMUX_INITIALIZER_UNLOCKED;
+
+		static inline uint8_t classFor(size_t size) {
+			if (size <= (1 << PSRAM_POOL_MIN_SHIFT)) {
+				return 0;
+			}
+			return 32 - __builtin_clz(size - 1) - PSRAM_POOL_MIN_SHIFT;
+		}
+		static inline size_t slotSize(uint8_t index) {
+			return 1 << (index + PSRAM_POOL_MIN_SHIFT);
+		}
+		static inline Page * pageFor(void * ptr) {
+			return (Page *)((uintptr_t)ptr & ~(uintptr_t)(PSRAM_POOL_PAGE_SIZE - 1));
+		}
+		static Page * createPage(uint8_t index);
+		static inline void linkPage(SizeClass &sizeClass, Page * page) {
+			page->prev = nullptr;
+			page->next = sizeClass.partial;
+			if (page->next) {
+				page->next->prev = page;
+			}
+			sizeClass.partial = page;
+		}
+		static inline void unlinkPage(SizeClass &sizeClass, Page * page) {
+			if (page->prev) {
+				page->prev->next = page->next;
+			} else {
+				sizeClass.partial = page->next;
+			}
+			if (page->next) {
+				page->next->prev = page->prev;
+			}
+		}
+};
+
+PSRAMPool psramPool;
+
+// Allocate a page for a class, with all of its slots free
+// the header takes the place of the first slots
+PSRAMPool::Page * PSRAMPool::createPage(uint8_t index) {
+	auto caps = psramInit() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT;
+	auto memory = (uint8_t *) heap_caps_aligned_alloc(PSRAM_POOL_PAGE_SIZE, PSRAM_POOL_PAGE_SIZE, caps);
+	if (!memory) {
+		return nullptr;
+	}
+	auto slotLength = slotSize(index);
+	auto first = (sizeof(Page) + slotLength - 1) / slotLength;
+	auto slots = PSRAM_POOL_PAGE_SIZE / slotLength - first;
+	auto page = (Page *) memory;
+	page->used = 0;
+	page->slots = slots;
+	page->freeList = (FreeSlot *)(memory + first * slotLength);
+	for (size_t i = first; i < first + slots - 1; i++) {
+		((FreeSlot *)(memory + i * slotLength))->next = (FreeSlot *)(memory + (i + 1) * slotLength);
+	}
+	((FreeSlot *)(memory + (first + slots - 1) * slotLength))->next = nullptr;
+	return page;
+}
+
+void * PSRAMPool::allocate(size_t size) {
+	auto index = classFor(size);
+	auto &sizeClass = classes[index];
+
+	portENTER_CRITICAL(&lock);
+	if (!sizeClass.partial) {
+		// Class is exhausted, so add a new page of slots to it
+		// the heap is not called with the lock held
+		portEXIT_CRITICAL(&lock);
+		auto newPage = createPage(index);
+		if (!newPage) {
+			debug_log("PSRAMPool::allocate: failed to allocate page for %u byte slots\n\r", slotSize(index));
+			return nullptr;
+		}
+		portENTER_CRITICAL(&lock);
+		linkPage(sizeClass, newPage);
+		sizeClass.pages++;
+		sizeClass.emptyPages++;
+		sizeClass.free += newPage->slots;
+	}
+	auto page = sizeClass.partial;
+	auto slot = page->freeList;
+	page->freeList = slot->next;
+	if (page->used++ == 0) {
+		sizeClass.emptyPages--;
+	}
+	if (!page->freeList) {
+		unlinkPage(sizeClass, page);
+	}
+	sizeClass.used++;
+	sizeClass.free--;
+	portEXIT_CRITICAL(&lock);
+
+	PROFILE_ALLOC(size);
+	return slot;
+}
+
+void PSRAMPool::deallocate(void * ptr, size_t size) {
+	if (!ptr) {
+		return;
+	}
+	auto &sizeClass = classes[classFor(size)];
+	auto slot = (FreeSlot *)ptr;
+	auto page = pageFor(ptr);
+	Page * release = nullptr;
+
+	portENTER_CRITICAL(&lock);
+	if (!page->freeList) {
+		// page was full, so it has a free slot again
+		linkPage(sizeClass, page);
+	}
+	slot->next = page->freeList;
+	page->freeList = slot;
+	sizeClass.used--;
+	sizeClass.free++;
+	if (--page->used == 0) {
+		if (sizeClass.emptyPages == 0) {
+			sizeClass.emptyPages++;
+		} else {
+			// the class already has an empty page, so give this one back to the heap
+			unlinkPage(sizeClass, page);
+			sizeClass.pages--;
+			sizeClass.free -= page->slots;
+			release = page;
+		}
+	}
+	portEXIT_CRITICAL(&lock);
+
+	if (release) {
+		heap_caps_free(release);
+	}
+}
+
+PSRAMPool::Stats PSRAMPool::getStats(uint8_t index) {
+	Stats stats = {};
+	if (index >= PSRAM_POOL_CLASSES) {
+		return stats;
+	}
+	portENTER_CRITICAL(&lock);
+	auto &sizeClass = classes[index];
+	stats.slotSize = slotSize(index);
+	stats.pages = sizeClass.pages;
+	stats.used = sizeClass.used;
+	stats.free = sizeClass.free;
+	portEXIT_CRITICAL(&lock);
+	return stats;
+}
+
+void PSRAMPool::report() {
+	uint32_t pages = 0;
+	uint32_t usedBytes = 0;
+	force_debug_log("PSRAM pool classes:\n\r");
+	for (auto index = 0; index < PSRAM_POOL_CLASSES; index++) {
+		auto stats = getStats(index);
+		pages += stats.pages;
+		usedBytes += stats.used * stats.slotSize;
+		if (stats.pages == 0) {
+			continue;
+		}
+		auto total = stats.used + stats.free;
+		force_debug_log("  %4u bytes: %u pages, %u/%u slots used (%.1f%%), %u bytes free\n\r",
+			stats.slotSize, stats.pages, stats.used, total,
+			total ? stats.used * 100.0f / total : 0.0f, stats.free * stats.slotSize);
+	}
+	force_debug_log("PSRAM pool: %u bytes in %u pages, %u bytes in use\n\r",
+		pages * PSRAM_POOL_PAGE_SIZE, pages, usedBytes);
+	force_debug_log("PSRAM heap: %u bytes free, largest free block %u bytes\n\r",
+		heap_caps_get_free_size(MALLOC_CAP_SPIRAM), heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+	force_debug_log("Internal heap: %u bytes free, largest free block %u bytes\n\r",
+		heap_caps_get_free_size(MALLOC_CAP_INTERNAL), heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+}
+
+#endif // PSRAM_POOL_H
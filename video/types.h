@@ -39,12 +39,16 @@
 #include <optional>
 #include <memory>
 
+#include "profiling.h"
+#include "psram_pool.h"
+
 // PreferPSRAMAlloc
 //
 // Will return PSRAM if it's available, regular ram otherwise
 
 inline void * PreferPSRAMAlloc(size_t s)
 {
+	PROFILE_ALLOC(s);
 	if (psramInit())
 	{
 		debug_log("PSRAM Array Request for %u bytes\n", s);
@@ -91,15 +95,27 @@ public:
 	const_pointer address(const_reference x) const {return &x;}
 	size_type max_size() const throw() {return size_t(-1) / sizeof(value_type);}
 
+	// Small allocations come from the PSRAM pool, which needs the size back when freeing
+
 	pointer allocate(size_type n, const void * hint = 0)
 	{
-		void * pmem = PreferPSRAMAlloc(n*sizeof(T));
+		auto size = n * sizeof(T);
+		void * pmem = PSRAMPool::isPooled(size) ? psramPool.allocate(size) : PreferPSRAMAlloc(size);
 		return static_cast<pointer>(pmem) ;
 	}
 
 	void deallocate(pointer p, size_type n)
 	{
-		free(p);
+		PROFILE_FREE();
+		auto size = n * sizeof(T);
+		if (PSRAMPool::isPooled(size))
+		{
+			psramPool.deallocate(p, size);
+		}
+		else
+		{
+			free(p);
+		}
 	}
 
 	template< class U, class... Args >
@@ -128,28 +144,46 @@ struct psram_deleter
 	}
 };
 
+// psram_array_deleter
+//
+// Arrays may come from the PSRAM pool, so the deleter remembers the array size to hand back on free
+
+template<typename T>
+struct psram_array_deleter
+{
+	size_t size = 0;
+
+	void operator()(T* ptr)
+	{
+		psram_allocator<T> allocator;
+		allocator.deallocate(ptr, size);
+	}
+};
+
+template<typename T>
+using psram_unique_array = std::unique_ptr<T[], psram_array_deleter<T>>;
+
 // make_unique_psram
 //
 // Like std::make_unique, but returns PSRAM instead of base RAM.  We cheat a little here by not providing
 // a deleter, because we know that PSRAM can be freed with the regular free() call and does not require
-// special handling.
+// special handling.  For that to hold these are never taken from the PSRAM pool.
 
 template<typename T, typename... Args>
 std::unique_ptr<T> make_unique_psram(Args&&... args)
 {
-	psram_allocator<T> allocator;
-	T* ptr = allocator.allocate(1);
-	allocator.construct(ptr, std::forward<Args>(args)...);
+	T* ptr = static_cast<T*>(PreferPSRAMAlloc(sizeof(T)));
+	::new((void *) ptr) T(std::forward<Args>(args)...);
 	return std::unique_ptr<T>(ptr);
 }
 
 template<typename T>
-std::unique_ptr<T[]> make_unique_psram_array(size_t size)
+psram_unique_array<T> make_unique_psram_array(size_t size)
 {
 	psram_allocator<T> allocator;
 	T* ptr = allocator.allocate(size);
 	// No need to call construct since arrays don't have constructors
-	return std::unique_ptr<T[]>(ptr);
+	return psram_unique_array<T>(ptr, psram_array_deleter<T>{size});
 }
 
 // make_shared_psram
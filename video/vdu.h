@@ -59,6 +59,8 @@ void VDUStreamProcessor::vdu(uint8_t c, bool usePeek) {
 		return;
 	}
 
+	PROFILE_SCOPE(PROFILE_VDU, c);
+
 	switch(c) {
 		case 0x01: {
 			// capture character and send to "printer" if enabled
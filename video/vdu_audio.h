@@ -262,9 +262,17 @@ uint8_t VDUStreamProcessor::createSampleFromBuffer(uint16_t bufferId, uint8_t fo
 		return 0;
 	}
 	clearSample(bufferId);
+	// samples take their own copy of the block list, so a compressed buffer's sample plays from a decompressed copy
+	auto bufferIter = buffers.find(bufferId);
+	auto data = bufferIter->compressed ? decompressionCache.get(bufferId, bufferIter->second) : nullptr;
+	if (bufferIter->compressed && !data) {
+		debug_log("vdu_sys_audio: buffer %d could not be decompressed\n\r", bufferId);
+		return 0;
+	}
+	auto &blocks = data ? *data : bufferIter->second;
 	auto sample = (format & AUDIO_FORMAT_WITH_RATE) ?
-		std::make_shared<AudioSample>(buffers[bufferId], format & AUDIO_FORMAT_DATA_MASK, sampleRate)
-		: std::make_shared<AudioSample>(buffers[bufferId], format & AUDIO_FORMAT_DATA_MASK);
+		std::make_shared<AudioSample>(blocks, format & AUDIO_FORMAT_DATA_MASK, sampleRate)
+		: std::make_shared<AudioSample>(blocks, format & AUDIO_FORMAT_DATA_MASK);
 	if (sample) {
 		if (format & AUDIO_FORMAT_TUNEABLE) {
 			sample->baseFrequency = AUDIO_DEFAULT_FREQUENCY;
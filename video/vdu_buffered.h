@@ -15,8 +15,10 @@
 #include "buffers.h"
 #include "buffer_stream.h"
 #include "compression.h"
+#include "decompression_cache.h"
 #include "mem_helpers.h"
 #include "multi_buffer_stream.h"
+#include "parallel.h"
 #include "sprites.h"
 #include "test_flags.h"
 #include "types.h"
@@ -28,6 +30,59 @@
 void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 	auto bufferId = readWord_t(); if (bufferId == -1) return;
 	auto command = readByte_t(); if (command == -1) return;
+	vdu_sys_buffered(bufferId, command);
+}
+
+// Fast path for commands running from a buffer
+// If the next command is a VDU 23, 0, &A0, bufferId; command header it is dispatched directly,
+// bypassing vdu(), vdu_sys() and vdu_sys_video().  The header comes from the buffer's list of
+// pre-decoded commands if it is there, or else is decoded from buffer memory and added to the list
+// commands holds the list for the blocks being run, and is updated when we move to other blocks
+// Returns false if the next command needs to go through the normal path
+//
+bool IRAM_ATTR VDUStreamProcessor::dispatchBufferedCommand(std::shared_ptr<CommandList> &commands) {
+	if (id == 65535 || consoleMode || printerOn || !commandsEnabled) {
+		return false;
+	}
+	auto instream = (MultiBufferStream *)inputStream.get();
+	uint32_t offset;
+	size_t blockIndex;
+	auto &blocks = instream->tellBuffer(offset, blockIndex);
+	if (blockIndex >= blocks.size()) {
+		return false;
+	}
+	if (!commands || commands->source() != &blocks) {
+		commands = commandCache.get(id, blocks);
+	}
+	auto &block = blocks[blockIndex];
+	if (commands) {
+		auto cached = commands->find(blockIndex, offset);
+		if (cached && cached->writeCount == block->writeCount()) {
+			instream->skipBytes(6);
+			vdu_sys_buffered(cached->bufferId, cached->command);
+			return true;
+		}
+	}
+
+	size_t length;
+	auto data = instream->peekBlock(length);
+	if (length < 6 || data[0] != 23 || data[1] != 0 || data[2] != VDP_BUFFERED) {
+		return false;
+	}
+	uint16_t bufferId = data[3] | (data[4] << 8);
+	uint8_t command = data[5];
+	if (commands && !block->isPinned()) {
+		commands->record({ (uint32_t)blockIndex, offset, block->writeCount(), bufferId, command });
+	}
+	instream->skipBytes(6);
+	vdu_sys_buffered(bufferId, command);
+	return true;
+}
+
+// Buffered command dispatch, once the bufferId and command have been read
+//
+void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered(uint16_t bufferId, uint8_t command) {
+	PROFILE_SCOPE(PROFILE_BUFFERED, command);
 
 	switch (command) {
 		case BUFFERED_WRITE: {
@@ -45,7 +100,7 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 			auto buffer = bufferCreate(bufferId, size);	
 			if (buffer) {
 				// Ensure buffer is empty
-				memset(buffer->getBuffer(), 0, size);
+				memset(buffer->getWritableBuffer(), 0, size);
 			}
 		}	break;
 		case BUFFERED_SET_OUTPUT: {
@@ -193,6 +248,14 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 			}
 			bufferCopyAndConsolidate(bufferId, sourceBufferIds);
 		}	break;
+		case BUFFERED_SCATTER_WRITE: {
+			auto count = readWord_t(); if (count == -1) return;
+			bufferScatterWrite(count);
+		}	break;
+		case BUFFERED_WRITE_COMPRESSED: {
+			auto length = read24_t(); if (length == -1) return;
+			bufferWriteCompressed(bufferId, length);
+		}	break;
 		case BUFFERED_AFFINE_TRANSFORM: if (isTestFlagSet(TEST_FLAG_AFFINE_TRANSFORM)) {
 			auto operation = readByte_t(); if (operation == -1) return;
 			bufferAffineTransform(bufferId, operation, false);
@@ -240,6 +303,28 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 			if (sourceBufferId == -1) return;
 			bufferDecompress(bufferId, sourceBufferId);
 		}	break;
+		case BUFFERED_COMPRESS_WITH: {
+			auto type = readByte_t(); if (type == -1) return;
+			auto sourceBufferId = readWord_t(); if (sourceBufferId == -1) return;
+			switch (type) {
+				case COMPRESS_TURBO:
+					bufferCompress(bufferId, sourceBufferId);
+					break;
+				case COMPRESS_LZ:
+					bufferCompressLZ(bufferId, sourceBufferId);
+					break;
+				case COMPRESS_TURBO_PARALLEL:
+					bufferCompressParallel(bufferId, sourceBufferId);
+					break;
+				default:
+					debug_log("vdu_sys_buffered: unknown compression type %d\n\r", type);
+					break;
+			}
+		}	break;
+		case BUFFERED_SET_COMPRESSED: {
+			auto compressed = readByte_t(); if (compressed == -1) return;
+			bufferSetCompressed(bufferId, compressed != 0);
+		}	break;
 		case BUFFERED_EXPAND_BITMAP: {
 			auto options = readByte_t(); if (options == -1) return;
 			auto sourceBufferId = readWord_t();
@@ -293,7 +378,7 @@ uint32_t VDUStreamProcessor::bufferWrite(uint16_t bufferId, uint32_t length) {
 
 	debug_log("bufferWrite: storing stream into buffer %d, length %d\n\r", bufferId, length);
 
-	auto remaining = readIntoBuffer(bufferStream->getBuffer(), length);
+	auto remaining = readIntoBuffer(bufferStream->getWritableBuffer(), length);
 	if (remaining > 0) {
 		// NB this discards the data we just read
 		debug_log("bufferWrite: timed out write for buffer %d (%d bytes remaining)\n\r", bufferId, remaining);
@@ -307,10 +392,132 @@ uint32_t VDUStreamProcessor::bufferWrite(uint16_t bufferId, uint32_t length) {
 	}
 
 	buffers[bufferId].push_back(std::move(bufferStream));
+	decompressionCache.invalidate(bufferId);
 	debug_log("bufferWrite: stored stream in buffer %d, length %d, %d streams stored\n\r", bufferId, length, buffers[bufferId].size());
 	return remaining;
 }
 
+// VDU 23, 0, &A0, 65535; &1B, count; <bufferId; length;>... <data>: Write to multiple buffers
+// Adds a block to each buffer listed in the table, in table order
+// with the data for all of the blocks following the table as one contiguous payload
+// This is equivalent to a series of buffer writes, without a command header to parse for each
+//
+void VDUStreamProcessor::bufferScatterWrite(uint16_t count) {
+	uint32_t tableSize = count * 4;
+	auto table = make_unique_psram_array<uint8_t>(tableSize);
+	if (!table) {
+		// read through the table without keeping it, to find how much data follows it
+		debug_log("bufferScatterWrite: failed to allocate table of %d entries\n\r", count);
+		uint32_t dataLength = 0;
+		for (auto i = 0; i < count; i++) {
+			uint8_t entry[4];
+			if (readIntoBuffer(entry, sizeof(entry)) != 0) {
+				discardBytes((count - i - 1) * 4 + dataLength);
+				return;
+			}
+			dataLength += entry[2] | (entry[3] << 8);
+		}
+		discardBytes(dataLength);
+		return;
+	}
+	auto remaining = readIntoBuffer(table.get(), tableSize);
+	if (remaining != 0) {
+		// discard the rest of the table, and the data for the entries we did get
+		debug_log("bufferScatterWrite: failed to read table of %d entries\n\r", count);
+		uint32_t dataLength = 0;
+		for (uint32_t offset = 0; offset + 4 <= tableSize - remaining; offset += 4) {
+			dataLength += table[offset + 2] | (table[offset + 3] << 8);
+		}
+		discardBytes(remaining + dataLength);
+		return;
+	}
+
+	auto entry = table.get();
+	for (auto i = 0; i < count; i++, entry += 4) {
+		uint16_t bufferId = entry[0] | (entry[1] << 8);
+		uint16_t length = entry[2] | (entry[3] << 8);
+		auto unread = bufferWrite(bufferId, length);
+		if (unread != 0) {
+			debug_log("bufferScatterWrite: write %d of %d to buffer %d failed\n\r", i + 1, count, bufferId);
+			// discard the rest of this block's data, and all of the data for the blocks after it
+			for (auto next = entry + 4; next < table.get() + tableSize; next += 4) {
+				unread += next[2] | (next[3] << 8);
+			}
+			discardBytes(unread);
+			return;
+		}
+	}
+	debug_log("bufferScatterWrite: wrote %d blocks\n\r", count);
+}
+
+// VDU 23, 0, &A0, bufferId; &1C, length; lengthHighByte, data...: Write compressed data to a buffer
+// data is in the TurboVega compressed format, including its header, as made by command &40
+// length is 24-bit, so data that decompresses to more than 64KB can be sent in one go
+// It is decompressed as it is received, and the buffer gets a block of the decompressed data
+// so more data can be sent in the same time, without keeping a compressed copy around
+//
+uint32_t VDUStreamProcessor::bufferWriteCompressed(uint16_t bufferId, uint32_t length) {
+	debug_log("bufferWriteCompressed: receiving %d compressed bytes for buffer %d\n\r", length, bufferId);
+
+	CompressionFileHeader hdr;
+	if (length < sizeof(hdr)) {
+		debug_log("bufferWriteCompressed: data too short for header\n\r");
+		return discardBytes(length);
+	}
+	auto remaining = readIntoBuffer((uint8_t *)&hdr, sizeof(hdr));
+	if (remaining > 0) {
+		debug_log("bufferWriteCompressed: timed out reading header\n\r");
+		return remaining + length - sizeof(hdr);
+	}
+	length -= sizeof(hdr);
+	if (hdr.marker[0] != 'C' || hdr.marker[1] != 'm' || hdr.marker[2] != 'p' || hdr.type != COMPRESSION_TYPE_TURBO) {
+		// only the TurboVega format can be decoded a byte at a time
+		debug_log("bufferWriteCompressed: header is invalid\n\r");
+		return discardBytes(length);
+	}
+
+	auto bufferStream = make_shared_psram<BufferStream>(hdr.orig_size);
+	if (!bufferStream || !bufferStream->getBuffer()) {
+		debug_log("bufferWriteCompressed: failed to create buffer of %u bytes\n\r", hdr.orig_size);
+		return discardBytes(length);
+	}
+
+	// decode each chunk as it arrives, straight into the new block
+	auto output = bufferStream->getWritableBuffer();
+	DecompressionData dd;
+	agon_init_decompression(&dd, nullptr, nullptr, hdr.orig_size);
+	uint8_t chunk[256];
+	while (length > 0) {
+		auto chunkSize = std::min<uint32_t>(length, sizeof(chunk));
+		remaining = readIntoBuffer(chunk, chunkSize);
+		auto fits = agon_decompress_block(&dd, chunk, chunkSize - remaining, output);
+		length -= chunkSize - remaining;
+		if (!fits) {
+			// stop as soon as the data overflows the original size, and skip the rest of it
+			debug_log("bufferWriteCompressed: data decompresses to more than %u bytes\n\r", hdr.orig_size);
+			return remaining > 0 ? length : discardBytes(length);
+		}
+		if (remaining > 0) {
+			// NB this discards the data we have decompressed
+			debug_log("bufferWriteCompressed: timed out write for buffer %d (%d bytes remaining)\n\r", bufferId, length);
+			return length;
+		}
+	}
+	if (dd.output_count != hdr.orig_size) {
+		debug_log("bufferWriteCompressed: decompressed %u bytes, expected %u\n\r", dd.output_count, hdr.orig_size);
+		return 0;
+	}
+
+	if (bufferId == 65535) {
+		debug_log("bufferWriteCompressed: ignoring buffer 65535\n\r");
+		return 0;
+	}
+	buffers[bufferId].push_back(std::move(bufferStream));
+	decompressionCache.invalidate(bufferId);
+	debug_log("bufferWriteCompressed: stored %u bytes in buffer %d\n\r", hdr.orig_size, bufferId);
+	return 0;
+}
+
 // VDU 23, 0, &A0, bufferId; 1: Call buffer
 // VDU 23, 0, &A0, bufferId; &0B, offset; offsetHighByte  : Offset call
 // Processes all commands from the streams stored against the given bufferId
@@ -345,19 +552,37 @@ void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset
 		debug_log("bufferCall: buffer %d not found\n\r", bufferId);
 		return;
 	}
-	auto &streams = bufferIter->second;
-	std::shared_ptr<Stream> callInputStream = make_shared_psram<MultiBufferStream>(streams);
+	// use the stream for this call depth, creating it if this is our deepest call so far
+	if (callStreams.size() <= callDepth) {
+		callStreams.push_back(make_shared_psram<MultiBufferStream>());
+	}
+	std::shared_ptr<Stream> callInputStream = callStreams[callDepth];
+	auto callStream = (MultiBufferStream *)callInputStream.get();
+	if (bufferIter->compressed) {
+		// run the commands from a decompressed copy, which the stream keeps hold of
+		auto decompressed = decompressionCache.get(bufferId, bufferIter->second);
+		if (!decompressed) {
+			debug_log("bufferCall: buffer %d could not be decompressed\n\r", bufferId);
+			return;
+		}
+		callStream->attach(std::move(decompressed));
+	} else {
+		callStream->attach(bufferIter->second);
+	}
 	if (offset.blockOffset != 0 || offset.blockIndex != 0) {
-		auto multiBufferStream = (MultiBufferStream *)callInputStream.get();
-		multiBufferStream->seekTo(offset.blockOffset, offset.blockIndex);
+		callStream->seekTo(offset.blockOffset, offset.blockIndex);
 	}
 	// use the current VDUStreamProcessor, swapping out the stream
+	callDepth++;
 	std::swap(id, callBufferId);
 	std::swap(inputStream, callInputStream);
 	processAllAvailable();
 	// restore the original buffer id and stream
 	id = callBufferId;
-	inputStream = std::move(callInputStream);
+	std::swap(inputStream, callInputStream);
+	// release the (possibly jumped-to) stream's current block
+	((MultiBufferStream *)callInputStream.get())->detach();
+	callDepth--;
 	if (id != 65535) {
 		// return to the appropriate offset
 		auto multiBufferStream = (MultiBufferStream *)inputStream.get();
@@ -367,6 +592,8 @@ void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset
 
 void VDUStreamProcessor::bufferRemoveUsers(uint16_t bufferId) {
 	// remove all users of the given buffer
+	decompressionCache.invalidate(bufferId);
+	commandCache.invalidate(bufferId);
 	context->unmapBitmapFromChars(bufferId);
 	clearBitmap(bufferId);
 	clearFont(bufferId);
@@ -382,6 +609,8 @@ void VDUStreamProcessor::bufferClear(uint16_t bufferId) {
 	if (bufferId == 65535) {
 		buffers.clear();
 		matrixMetadata.clear();
+		decompressionCache.clear();
+		commandCache.clear();
 		resetBitmaps();
 		// TODO reset current bitmaps in all processors
 		context->setCurrentBitmap(BUFFERED_BITMAP_BASEID);
@@ -699,7 +928,7 @@ struct AdjustMultiSingle {
 };
 template<uint8_t Operator, typename = void>
 struct AdjustSingleMulti {
-	static uint_fast8_t adjust(uint_fast8_t target, uint8_t * operand, bool &carry, size_t count) {
+	static uint_fast8_t adjust(uint_fast8_t target, const uint8_t * operand, bool &carry, size_t count) {
 		bool localCarry = carry;
 		for (size_t i = 0; i < count; i++) {
 			target = AdjustSingle<Operator>::adjust(target, operand[i], localCarry);
@@ -713,7 +942,7 @@ struct AdjustSingleMulti {
 // Specialization if a fold operation is provided
 template<uint8_t Operator>
 struct AdjustSingleMulti<Operator, decltype(void(AdjustSingle<Operator>::fold))> {
-	static uint_fast8_t adjust(uint_fast8_t target, uint8_t * operand, bool &carry, size_t count) {
+	static uint_fast8_t adjust(uint_fast8_t target, const uint8_t * operand, bool &carry, size_t count) {
 		bool localCarry = carry;
 		if (count >= sizeof(uint32_t)) {
 			if (reinterpret_cast<uintptr_t>(operand) & 1) {
@@ -753,7 +982,7 @@ struct AdjustSingleMulti<Operator, decltype(void(AdjustSingle<Operator>::fold))>
 };
 template<uint8_t Operator>
 struct AdjustMulti {
-	static void adjust(uint8_t * target, uint8_t * operand, bool &carry, size_t count, bool sameBuffer) {
+	static void adjust(uint8_t * target, const uint8_t * operand, bool &carry, size_t count, bool sameBuffer) {
 		bool localCarry = carry;
 		if (count >= sizeof(uint32_t) && (!sameBuffer || target <= operand || target >= operand + sizeof(uint32_t))) {
 			if (reinterpret_cast<uintptr_t>(target) & 1) {
@@ -875,6 +1104,7 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 		debug_log("bufferAdjust: invalid command, count, offset or operand value\n\r");
 		return;
 	}
+	decompressionCache.invalidate(bufferId);
 
 	MultiBufferStream * instream = nullptr;
 	tcb::span<uint8_t> targetSpan;
@@ -906,7 +1136,7 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 	}
 	if (!useMultiTarget) {
 		// we have a singular target value
-		targetSpan = getBufferSpan(buffer, offset);
+		targetSpan = getWritableBufferSpan(buffer, offset);
 		if (targetSpan.empty()) {
 			debug_log("bufferAdjust: invalid target offset\n\r");
 			return;
@@ -962,7 +1192,7 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 			auto func = adjustMultiSingleFuncs[op];
 			auto operandWord = (uint8_t)operandValue * (uint32_t)0x01010101;
 			while (count > 0) {
-				targetSpan = getBufferSpan(buffer, offset);
+				targetSpan = getWritableBufferSpan(buffer, offset);
 				auto iterCount = std::min<size_t>(targetSpan.size(), count);
 				if (iterCount == 0) {
 					debug_log("bufferAdjust: target buffer overflow\n\r");
@@ -975,7 +1205,7 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 		} else if (operandBuffer) {
 			auto func = adjustMultiFuncs[op];
 			while (count > 0) {
-				targetSpan = getBufferSpan(buffer, offset);
+				targetSpan = getWritableBufferSpan(buffer, offset);
 				auto operandSpan = getBufferSpan(*operandBuffer, operandOffset);
 				auto iterCount = std::min<size_t>(std::min(targetSpan.size(), operandSpan.size()), count);
 				if (iterCount == 0) {
@@ -997,7 +1227,7 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 		} else {
 			auto func = adjustSingleFuncs[op];
 			while (count > 0) {
-				targetSpan = getBufferSpan(buffer, offset);
+				targetSpan = getWritableBufferSpan(buffer, offset);
 				auto iterCount = std::min<size_t>(targetSpan.size(), count);
 				if (iterCount == 0) {
 					debug_log("bufferAdjust: target buffer overflow\n\r");
@@ -1150,14 +1380,22 @@ void VDUStreamProcessor::bufferJump(uint16_t bufferId, AdvancedOffset offset) {
 		debug_log("bufferJump: buffer %d not found\n\r", bufferId);
 		return;
 	}
-	// replace our input stream with a new one
-	auto &streams = bufferIter->second;
-	auto multiBufferStream = make_shared_psram<MultiBufferStream>(streams);
+	// point our input stream at the new buffer
+	auto instream = (MultiBufferStream *)inputStream.get();
+	if (bufferIter->compressed) {
+		auto decompressed = decompressionCache.get(bufferId, bufferIter->second);
+		if (!decompressed) {
+			debug_log("bufferJump: buffer %d could not be decompressed\n\r", bufferId);
+			return;
+		}
+		instream->attach(std::move(decompressed));
+	} else {
+		instream->attach(bufferIter->second);
+	}
 	if (offset.blockOffset != 0 || offset.blockIndex != 0) {
-		multiBufferStream->seekTo(offset.blockOffset, offset.blockIndex);
+		instream->seekTo(offset.blockOffset, offset.blockIndex);
 	}
 	id = bufferId;
-	inputStream = std::move(multiBufferStream);
 }
 
 // VDU 23, 0, &A0, bufferId; &0D, sourceBufferId; sourceBufferId; ...; 65535; : Copy blocks from buffers
@@ -1183,13 +1421,13 @@ void VDUStreamProcessor::bufferCopy(uint16_t bufferId, tcb::span<const uint16_t>
 			// loop thru blocks stored against this ID
 			for (const auto &block : sourceBufferIter->second) {
 				// push a copy of the block into our vector
-				auto bufferStream = make_shared_psram<BufferStream>(block->size());
+				// the copy shares the block's data until one of them is written to
+				auto bufferStream = BufferStream::share(block, 0, block->size());
 				if (!bufferStream || !bufferStream->getBuffer()) {
 					debug_log("bufferCopy: failed to create buffer\n\r");
 					return;
 				}
 				debug_log("bufferCopy: copying stream %d bytes\n\r", block->size());
-				bufferStream->writeBuffer(block->getBuffer(), block->size());
 				streams.push_back(std::move(bufferStream));
 			}
 		} else {
@@ -1380,7 +1618,8 @@ void VDUStreamProcessor::bufferReverseBlocks(uint16_t bufferId) {
 	if (bufferIter != buffers.end()) {
 		// reverse the order of the streams
 		auto &buffer = bufferIter->second;
-		std::reverse(buffer.begin(), buffer.end());
+		buffer.reverse();
+		decompressionCache.invalidate(bufferId);
 		debug_log("bufferReverseBlocks: reversed blocks in buffer %d\n\r", bufferId);
 	}
 }
@@ -1443,14 +1682,19 @@ void VDUStreamProcessor::bufferReverse(uint16_t bufferId, uint8_t options) {
 	}
 
 	debug_log("bufferReverse: reversing buffer %d, value size %d, chunk size %d\n\r", bufferId, valueSize, chunkSize);
+	decompressionCache.invalidate(bufferId);
 
 	for (const auto &block : buffer) {
+		auto data = block->getWritableBuffer();
+		if (!data) {
+			debug_log("bufferReverse: failed to write to block in buffer %d\n\r", bufferId);
+			return;
+		}
 		if (chunkSize == 0) {
 			// no chunking, so simpler reverse
-			reverseValues(block->getBuffer(), block->size(), valueSize);
+			reverseValues(data, block->size(), valueSize);
 		} else {
 			// reverse in chunks
-			auto data = block->getBuffer();
 			auto chunkCount = block->size() / chunkSize;
 			for (auto i = 0; i < chunkCount; i++) {
 				reverseValues(data + (i * chunkSize), chunkSize, valueSize);
@@ -1460,7 +1704,7 @@ void VDUStreamProcessor::bufferReverse(uint16_t bufferId, uint8_t options) {
 
 	if (reverseBlocks) {
 		// reverse the order of the streams
-		std::reverse(buffer.begin(), buffer.end());
+		buffer.reverse();
 		debug_log("bufferReverse: reversed blocks in buffer %d\n\r", bufferId);
 	}
 
@@ -1543,7 +1787,13 @@ void VDUStreamProcessor::bufferCopyAndConsolidate(uint16_t bufferId, tcb::span<c
 		buffer.push_back(std::move(bufferStream));
 	}
 
-	auto destination = buffer.front()->getBuffer();
+	auto destination = buffer.front()->getWritableBuffer();
+	if (!destination) {
+		debug_log("bufferCopyAndConsolidate: failed to write to buffer %d\n\r", bufferId);
+		return;
+	}
+	// the block may be re-used, and written to in place
+	decompressionCache.invalidate(bufferId);
 
 	// loop thru buffer IDs
 	for (const auto sourceId : sourceBufferIds) {
@@ -2099,7 +2349,7 @@ void VDUStreamProcessor::bufferTransformBitmap(uint16_t bufferId, uint8_t option
 	}
 
 	// iterate over our destination buffer, and apply the transformation to each pixel
-	auto destination = (RGBA2222 *)bufferStream->getBuffer();
+	auto destination = (RGBA2222 *)bufferStream->getWritableBuffer();
 	float pos[3] = {0.0f, 0.0f, 1.0f};
 	float srcPos[3] = {0.0f, 0.0f, 1.0f};
 
@@ -2312,6 +2562,65 @@ void VDUStreamProcessor::bufferTransformData(uint16_t bufferId, uint8_t options,
 }
 
 
+// Output for compression, which writes straight into a chain of new buffer blocks
+// Blocks double in size as the output grows, so output is never copied to make room
+//
+struct CompressedBlockWriter {
+	BufferVector					blocks;
+	std::shared_ptr<BufferStream>	block;		// block being filled
+	uint8_t *						data = nullptr;
+	uint32_t						used = 0;
+	bool							failed = false;
+
+	void write(uint8_t byte) {
+		if (!block || used == block->size()) {
+			if (failed) {
+				return;
+			}
+			uint32_t size = COMPRESSION_OUTPUT_CHUNK_SIZE;
+			if (block) {
+				size = std::min<uint32_t>(block->size() * 2, COMPRESSION_OUTPUT_MAX_BLOCK);
+				blocks.push_back(std::move(block));
+			}
+			block = make_shared_psram<BufferStream>(size);
+			data = block ? block->getWritableBuffer() : nullptr;
+			used = 0;
+			if (!data) {
+				debug_log("CompressedBlockWriter: cannot allocate block of %d bytes\n\r", size);
+				block.reset();
+				failed = true;
+				return;
+			}
+		}
+		data[used++] = byte;
+	}
+
+	// Add the block being filled to the output, trimmed to the bytes used
+	bool finish() {
+		if (failed) {
+			return false;
+		}
+		if (block && used > 0) {
+			if (used < block->size()) {
+				auto trimmed = make_shared_psram<BufferStream>(used);
+				if (!trimmed || !trimmed->getBuffer()) {
+					return false;
+				}
+				trimmed->writeBuffer(data, used, 0);
+				block = std::move(trimmed);
+			}
+			blocks.push_back(std::move(block));
+		}
+		return true;
+	}
+};
+
+static void write_compressed_block_byte(void* p_cd, uint8_t comp_byte) {
+	auto cd = (CompressionData*) p_cd;
+	((CompressedBlockWriter*) cd->context)->write(comp_byte);
+	cd->output_count++;
+}
+
 // VDU 23, 0, &A0, bufferId; &40, sourceBufferId; : Compress blocks from a buffer
 // Compress (blocks from) a buffer into a new buffer.
 // Replaces the target buffer with the new one.
@@ -2325,75 +2634,203 @@ void VDUStreamProcessor::bufferCompress(uint16_t bufferId, uint16_t sourceBuffer
 		return;
 	}
 
-	// create a temporary output buffer, which may be expanded during compression
-	uint8_t* p_temp = (uint8_t*) ps_malloc(COMPRESSION_OUTPUT_CHUNK_SIZE);
-	if (p_temp) {
-		// prepare for doing compression
-		CompressionData cd;
-		agon_init_compression(&cd, &p_temp, &local_write_compressed_byte);
-
-		// Output the compression header
-		CompressionFileHeader hdr;
-		hdr.marker[0] = 'C';
-		hdr.marker[1] = 'm';
-		hdr.marker[2] = 'p';
-		hdr.type = COMPRESSION_TYPE_TURBO;
-		hdr.orig_size = 0;
-
-		auto p_hdr_bytes = hdr.marker;
-		for (int i = 0; i < sizeof(hdr); i++) {
-			local_write_compressed_byte(&cd, *p_hdr_bytes++);
-		}
-
-		// loop thru blocks stored against the source buffer ID
-		uint32_t orig_size = 0;
-		auto &sourceBuffer = sourceBufferIter->second;
-		for (const auto &block : sourceBuffer) {
-			// compress the block into our temporary buffer
-			auto bufferLength = block->size();
-			auto p_data = block->getBuffer();
-			orig_size += bufferLength;
-			debug_log(" from buffer %u [%08X] %u bytes\n\r", sourceBufferId, p_data, bufferLength);
-			debug_log(" %02hX %02hX %02hX %02hX\n\r",
-						p_data[0], p_data[1], p_data[2], p_data[3]);
-			cd.input_count += bufferLength;
-			while (bufferLength--) {
-				agon_compress_byte(&cd, *p_data++);
-			}
+	// the compression state holds the match index, so is kept off the stack
+	auto compressionData = make_unique_psram<CompressionData>();
+	if (!compressionData) {
+		debug_log("bufferCompress: cannot allocate compression state\n\r");
+		return;
+	}
+
+	// prepare for doing compression
+	CompressedBlockWriter writer;
+	auto &cd = *compressionData;
+	agon_init_compression(&cd, &writer, &write_compressed_block_byte);
+
+	// Output the compression header
+	CompressionFileHeader hdr;
+	hdr.marker[0] = 'C';
+	hdr.marker[1] = 'm';
+	hdr.marker[2] = 'p';
+	hdr.type = COMPRESSION_TYPE_TURBO;
+	hdr.orig_size = 0;
+
+	auto p_hdr_bytes = hdr.marker;
+	for (int i = 0; i < sizeof(hdr); i++) {
+		write_compressed_block_byte(&cd, *p_hdr_bytes++);
+	}
+
+	// loop thru blocks stored against the source buffer ID
+	uint32_t orig_size = 0;
+	auto &sourceBuffer = sourceBufferIter->second;
+	for (const auto &block : sourceBuffer) {
+		auto bufferLength = block->size();
+		auto p_data = block->getBuffer();
+		orig_size += bufferLength;
+		debug_log(" from buffer %u [%08X] %u bytes\n\r", sourceBufferId, p_data, bufferLength);
+		cd.input_count += bufferLength;
+		while (bufferLength--) {
+			agon_compress_byte(&cd, *p_data++);
 		}
+	}
+	agon_finish_compression(&cd);
+
+	if (!writer.finish()) {
+		debug_log("bufferCompress: failed to create buffer %d\n\r", bufferId);
+		return;
+	}
+	// fill in the size now we know it - the header is always in the first block
+	hdr.orig_size = orig_size;
+	writer.blocks.front()->writeBuffer(hdr.marker, sizeof(hdr), 0);
+
+	bufferClear(bufferId);
+	buffers[bufferId].assign(writer.blocks.begin(), writer.blocks.end());
+
+	uint32_t pct = cd.input_count ? (cd.output_count * 100) / cd.input_count : 0;
+	debug_log("Compressed %u input bytes to %u output bytes (%u%%) in %u blocks\n\r",
+			cd.input_count, cd.output_count, pct, writer.blocks.size());
+}
+
+// VDU 23, 0, &A0, bufferId; &43, 2, sourceBufferId; : Compress blocks from a buffer in parallel
+// As bufferCompress, but the data is split into chunks which are compressed independently
+// with the work shared between both cores, and can be decompressed the same way.
+// The header type is 'P', and each chunk of the result is in its own blocks
+//
+void VDUStreamProcessor::bufferCompressParallel(uint16_t bufferId, uint16_t sourceBufferId) {
+	debug_log("Compressing into buffer %u in parallel\n\r", bufferId);
+
+	auto sourceBufferIter = buffers.find(sourceBufferId);
+	if (sourceBufferIter == buffers.end()) {
+		debug_log("bufferCompressParallel: buffer %d not found\n\r", sourceBufferId);
+		return;
+	}
+	// the jobs keep their own reference to the source blocks, as they don't use the buffers table
+	auto source = sourceBufferIter->second;
+	auto orig_size = source.totalSize();
+	auto chunkCount = (orig_size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+	std::vector<CompressedBlockWriter, psram_allocator<CompressedBlockWriter>> writers(chunkCount);
+
+	runOnBothCores(chunkCount, [&](uint32_t index) {
+		auto &writer = writers[index];
+		auto compressionData = make_unique_psram<CompressionData>();
+		if (!compressionData) {
+			writer.failed = true;
+			return;
+		}
+		auto &cd = *compressionData;
+		agon_init_compression(&cd, &writer, &write_compressed_block_byte);
+
+		// room for the chunk header, which is filled in afterwards
+		CompressionChunkHeader chunkHeader = {};
+		auto p_hdr_bytes = (uint8_t *)&chunkHeader;
+		for (int i = 0; i < sizeof(chunkHeader); i++) {
+			write_compressed_block_byte(&cd, p_hdr_bytes[i]);
+		}
+
+		auto start = index * COMPRESSION_CHUNK_SIZE;
+		chunkHeader.orig_size = std::min<uint32_t>(COMPRESSION_CHUNK_SIZE, orig_size - start);
+		forEachBufferSpan(source, start, chunkHeader.orig_size, [&](const uint8_t * data, uint32_t length) {
+			cd.input_count += length;
+			while (length--) {
+				agon_compress_byte(&cd, *data++);
+			}
+		});
 		agon_finish_compression(&cd);
 
-		// make a single buffer with all of the temporary output data
-		auto bufferStream = make_shared_psram<BufferStream>(cd.output_count);
-		if (!bufferStream || !bufferStream->getBuffer()) {
-			// buffer couldn't be created
-			debug_log("bufferCompress: failed to create buffer %d\n\r", bufferId);
+		if (!writer.finish()) {
+			writer.failed = true;
 			return;
 		}
+		chunkHeader.compressed_size = cd.output_count - sizeof(chunkHeader);
+		writer.blocks.front()->writeBuffer(p_hdr_bytes, sizeof(chunkHeader), 0);
+	});
 
-		auto p_hdr = (CompressionFileHeader*) p_temp;
-		p_hdr->orig_size = orig_size;
+	// the header goes in a block of its own, followed by the blocks of each chunk
+	auto header = make_shared_psram<BufferStream>(sizeof(CompressionFileHeader));
+	if (!header || !header->getBuffer()) {
+		debug_log("bufferCompressParallel: failed to create buffer %d\n\r", bufferId);
+		return;
+	}
+	CompressionFileHeader hdr;
+	hdr.marker[0] = 'C';
+	hdr.marker[1] = 'm';
+	hdr.marker[2] = 'p';
+	hdr.type = COMPRESSION_TYPE_PARALLEL;
+	hdr.orig_size = orig_size;
+	header->writeBuffer(hdr.marker, sizeof(hdr), 0);
+
+	BufferVector result;
+	result.push_back(std::move(header));
+	for (auto &writer : writers) {
+		if (writer.failed) {
+			debug_log("bufferCompressParallel: failed to compress buffer %d\n\r", sourceBufferId);
+			return;
+		}
+		result.insert(result.end(), writer.blocks.begin(), writer.blocks.end());
+	}
+	bufferClear(bufferId);
+	buffers[bufferId].swap(result);
 
-		auto destination = bufferStream->getBuffer();
-		debug_log(" %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX\n\r",
-					p_temp[0], p_temp[1], p_temp[2], p_temp[3],
-					p_temp[4], p_temp[5], p_temp[6], p_temp[7],
-					p_temp[8], p_temp[9], p_temp[10], p_temp[11]);
-		memcpy(destination, p_temp, cd.output_count);
-		heap_caps_free(p_temp);
-		bufferClear(bufferId);
-		buffers[bufferId].push_back(bufferStream);
+	debug_log("Compressed %u input bytes to %u output bytes in %u chunks\n\r",
+			orig_size, buffers[bufferId].totalSize(), chunkCount);
+}
 
-		uint32_t pct = (cd.output_count * 100) / cd.input_count;
-		debug_log("Compressed %u input bytes to %u output bytes (%u%%) at %08X\n\r",
-				cd.input_count, cd.output_count, pct, destination);
-	} else {
-		debug_log("bufferCompress: cannot allocate temporary buffer of %d bytes\n\r", COMPRESSION_OUTPUT_CHUNK_SIZE);
+// VDU 23, 0, &A0, bufferId; &43, 1, sourceBufferId; : Compress blocks from a buffer using LZ compression
+// As bufferCompress, but with the byte-aligned LZ format (type 'L' in the header)
+// which compresses better, and decompresses much faster
+//
+void VDUStreamProcessor::bufferCompressLZ(uint16_t bufferId, uint16_t sourceBufferId) {
+	debug_log("Compressing into buffer %u using LZ\n\r", bufferId);
+
+	auto sourceBufferIter = buffers.find(sourceBufferId);
+	if (sourceBufferIter == buffers.end()) {
+		debug_log("bufferCompressLZ: buffer %d not found\n\r", sourceBufferId);
+		return;
+	}
+	// LZ compression works on the whole buffer at once, so needs it to be contiguous
+	auto source = consolidateBuffers(sourceBufferIter->second);
+	if (!source) {
+		debug_log("bufferCompressLZ: failed to consolidate buffer %d\n\r", sourceBufferId);
+		return;
+	}
+	auto orig_size = source->size();
+
+	auto output = make_shared_psram<BufferStream>(sizeof(CompressionFileHeader) + agon_lz_compress_bound(orig_size));
+	if (!output || !output->getBuffer()) {
+		debug_log("bufferCompressLZ: failed to create buffer %d\n\r", bufferId);
+		return;
 	}
+	auto destination = output->getWritableBuffer();
+	auto p_hdr = (CompressionFileHeader*) destination;
+	p_hdr->marker[0] = 'C';
+	p_hdr->marker[1] = 'm';
+	p_hdr->marker[2] = 'p';
+	p_hdr->type = COMPRESSION_TYPE_LZ;
+	p_hdr->orig_size = orig_size;
+
+	auto compressedSize = agon_lz_compress(source->getBuffer(), orig_size, destination + sizeof(CompressionFileHeader));
+	if (compressedSize == 0) {
+		debug_log("bufferCompressLZ: compression failed\n\r");
+		return;
+	}
+	// copy just the used part of the worst-case output block, so the buffer doesn't hold on to the rest
+	auto usedSize = sizeof(CompressionFileHeader) + compressedSize;
+	auto bufferStream = make_shared_psram<BufferStream>(usedSize);
+	if (!bufferStream || !bufferStream->getBuffer()) {
+		debug_log("bufferCompressLZ: failed to create buffer %d\n\r", bufferId);
+		return;
+	}
+	memcpy(bufferStream->getWritableBuffer(), destination, usedSize);
+	output.reset();
+	bufferClear(bufferId);
+	buffers[bufferId].push_back(bufferStream);
+
+	debug_log("Compressed %u input bytes to %u output bytes (%u%%)\n\r",
+			orig_size, bufferStream->size(), orig_size ? (bufferStream->size() * 100) / orig_size : 0);
 }
 
 // VDU 23, 0, &A0, bufferId; &41, sourceBufferId; : Decompress blocks from a buffer
 // Decompress (blocks from) a buffer into a new buffer.
+// The compression type is taken from the header.
 // Replaces the target buffer with the new one.
 //
 void VDUStreamProcessor::bufferDecompress(uint16_t bufferId, uint16_t sourceBufferId) {
@@ -2405,77 +2842,45 @@ void VDUStreamProcessor::bufferDecompress(uint16_t bufferId, uint16_t sourceBuff
 		debug_log("bufferDeompress: buffer %d not found\n\r", sourceBufferId);
 		return;
 	}
-	auto &sourceBuffer = sourceBufferIter->second;
-
-	// Validate the compression header
-	if (sourceBuffer.size() >= 1 && sourceBuffer[0]->size() < sizeof(CompressionFileHeader)) {
-		debug_log("bufferDecompress: buffer too small for header\n\r");
-		return;
-	}
-	
-	auto p_hdr = (const CompressionFileHeader*) sourceBuffer[0]->getBuffer();
-	if (p_hdr->marker[0] != 'C' ||
-		p_hdr->marker[1] != 'm' ||
-		p_hdr->marker[2] != 'p' ||
-		p_hdr->type != COMPRESSION_TYPE_TURBO) {
-		debug_log("bufferDecompress: header is invalid\n\r");
-		return;
-	}
-	auto orig_size = p_hdr->orig_size;
 
 	debug_log("Decompressing into buffer %u\n\r", bufferId);
 
-	// create output buffer
-	auto bufferStream = make_shared_psram<BufferStream>(orig_size);
-	if (!bufferStream || !bufferStream->getBuffer()) {
-		// buffer couldn't be created
-		debug_log("bufferDecompress: failed to create buffer %d\n\r", bufferId);
+	auto bufferStream = decompressBuffer(sourceBufferIter->second);
+	if (!bufferStream) {
+		debug_log("bufferDecompress: failed to decompress buffer %d\n\r", sourceBufferId);
 		return;
 	}
 
-	// prepare for doing compression
-	auto buffer = bufferStream->getBuffer();
-	DecompressionData dd;
-	agon_init_decompression(&dd, &buffer, &local_write_decompressed_byte, orig_size);
-
-	// loop thru blocks stored against the source buffer ID
-	uint32_t skip_hdr = sizeof(CompressionFileHeader);
-	dd.input_count = skip_hdr;
-	for (const auto &block : sourceBuffer) {
-		// decompress the block into our temporary buffer
-		auto bufferLength = block->size() - skip_hdr;
-		auto p_data = block->getBuffer();
-		debug_log(" from buffer %u [%08X] %u bytes\n\r", sourceBufferId, p_data, bufferLength);
-		debug_log(" %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX %02hX\n\r",
-					p_data[0], p_data[1], p_data[2], p_data[3],
-					p_data[4], p_data[5], p_data[6], p_data[7],
-					p_data[8], p_data[9], p_data[10], p_data[11]);
-		p_data += skip_hdr;
-		skip_hdr = 0;
-		dd.input_count += bufferLength;
-		while (bufferLength--) {
-			agon_decompress_byte(&dd, *p_data++);
-		}
-	}
-
-	debug_log(" %02hX %02hX %02hX %02hX\n\r",
-				buffer[0], buffer[1], buffer[2], buffer[3]);
 	bufferClear(bufferId);
 	buffers[bufferId].push_back(bufferStream);
 
-	uint32_t pct = (dd.output_count * 100) / dd.input_count;
-	debug_log("Decompressed %u input bytes to %u output bytes (%u%%) at %08X\n\r",
-				dd.input_count, dd.output_count, pct, buffer);
-
-	if (dd.output_count != orig_size) {
-		debug_log("Decompressed buffer size %u does not equal original size %u\r\n",
-					dd.output_count, orig_size);
-	}
+	debug_log("Decompressed %u bytes into buffer %u\n\r", bufferStream->size(), bufferId);
 	#ifdef DEBUG
 	debug_log("Decompress took %u ms\n\r", millis() - start);
 	#endif
 }
 
+// VDU 23, 0, &A0, bufferId; &42, flag : Mark buffer as compressed
+// A flag of 1 marks a buffer as holding data in the Agon compressed format (as made by command &40)
+// The buffer is then kept compressed, and decompressed when it is called, or used for a sample, bitmap or font
+// Other buffer commands work on the compressed data
+// A flag of 0 clears the mark, so the buffer is treated as plain data again
+//
+void VDUStreamProcessor::bufferSetCompressed(uint16_t bufferId, bool compressed) {
+	auto bufferIter = buffers.find(bufferId);
+	if (bufferIter == buffers.end()) {
+		debug_log("bufferSetCompressed: buffer %d not found\n\r", bufferId);
+		return;
+	}
+	if (compressed && !isCompressedBuffer(bufferIter->second)) {
+		debug_log("bufferSetCompressed: buffer %d does not hold compressed data\n\r", bufferId);
+		return;
+	}
+	bufferIter->compressed = compressed;
+	decompressionCache.invalidate(bufferId);
+	debug_log("bufferSetCompressed: buffer %d marked as %s\n\r", bufferId, compressed ? "compressed" : "uncompressed");
+}
+
 // VDU 23, 0, &A0, bufferId; &48, options, sourceBufferId; [width;] [mapBufferId;] [mapValues...] : Expand a bitmap buffer
 // Expands a bitmap buffer into a new buffer with 8-bit values
 // options dictates how the expansion is done
@@ -2532,7 +2937,7 @@ void VDUStreamProcessor::bufferExpandBitmap(uint16_t bufferId, uint8_t options,
 			debug_log("bufferExpandBitmap: map buffer %d does not contain at least %d values\n\r", mapId, numValues);
 			return;
 		}
-		mapValues = buffer[0]->getBuffer();
+		mapValues = (uint8_t *)buffer[0]->getBuffer();
 	} else {
 		// read pixelSize bytes from stream
 		mapValues = (uint8_t *) ps_malloc(numValues);
@@ -2587,7 +2992,7 @@ void VDUStreamProcessor::bufferExpandBitmap(uint16_t bufferId, uint8_t options,
 		return;
 	}
 
-	auto destination = bufferStream->getBuffer();
+	auto destination = bufferStream->getWritableBuffer();
 
 	// iterate through source buffer
 	auto p_data = destination;
@@ -2690,7 +3095,7 @@ void VDUStreamProcessor::bufferUsePingo3D(uint16_t bufferId) {
 			if (h > 0) {
 				auto buffer = bufferCreate(bufferId, sizeof(Pingo3dControl));
 				if (buffer) {
-					auto ctrl = (Pingo3dControl*) buffer->getBuffer();
+					auto ctrl = (Pingo3dControl*) buffer->getWritableBuffer();
 					ctrl->initialize(*this, (uint16_t)w, (uint16_t)h);
 				}
 			} else {
@@ -2705,7 +3110,7 @@ void VDUStreamProcessor::bufferUsePingo3D(uint16_t bufferId) {
 		auto bufferIter = buffers.find(bufferId);
 		if (bufferIter != buffers.end()) {
 			auto &buffer = bufferIter->second;
-			auto ctrl = (Pingo3dControl*) buffer.begin()->get()->getBuffer();
+			auto ctrl = (Pingo3dControl*) buffer.begin()->get()->getWritableBuffer();
 			if (ctrl->validate()) {
 				ctrl->deinitialize(*this);
 				buffers.erase(bufferIter);
@@ -2719,7 +3124,7 @@ void VDUStreamProcessor::bufferUsePingo3D(uint16_t bufferId) {
         auto bufferIter = buffers.find(bufferId);
         if (bufferIter != buffers.end()) {
 			auto &buffer = bufferIter->second;
-			auto ctrl = (Pingo3dControl*) buffer.begin()->get()->getBuffer();
+			auto ctrl = (Pingo3dControl*) buffer.begin()->get()->getWritableBuffer();
             if (ctrl->validate()) {
                 ctrl->handle_subcommand(*this, subcmd);
             } else {
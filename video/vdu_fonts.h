@@ -64,7 +64,7 @@ void VDUStreamProcessor::vdu_sys_font() {
                 debug_log("fontCopySystem: failed to create buffer %d\n\r", bufferId);
                 return;
             }
-            memcpy(buff->getBuffer(), FONT_AGON.data, size);
+            memcpy(buff->getWritableBuffer(), FONT_AGON.data, size);
             auto fontCopy = createFontFromBuffer(bufferId, FONT_AGON.width, FONT_AGON.height, FONT_AGON.ascent, FONT_AGON.flags);
             if (fontCopy == nullptr) {
                 debug_log("fontCopySystem: failed to create font %d\n\r", bufferId);
@@ -263,7 +263,7 @@ void VDUStreamProcessor::createEmptyBitmap(uint16_t bufferId, uint16_t width, ui
 		debug_log("vdu_sys_sprites: failed to create buffer\n\r");
 		return;
 	}
-	auto dataptr = (uint32_t *)buffer->getBuffer();
+	auto dataptr = (uint32_t *)buffer->getWritableBuffer();
 	for (auto n = 0; n < size; n++) dataptr[n] = color;
 	// create RGBA8888 bitmap from buffer
 	createBitmapFromBuffer(bufferId, 0, width, height);
@@ -279,7 +279,7 @@ void VDUStreamProcessor::createEmptyBitmap2222(uint16_t bufferId, uint16_t width
 		debug_log("vdu_sys_sprites: failed to create buffer\n\r");
 		return;
 	}
-	auto dataptr = (uint8_t *)buffer->getBuffer();
+	auto dataptr = (uint8_t *)buffer->getWritableBuffer();
 	for (auto n = 0; n < size; n++) dataptr[n] = color;
 	// create RGBA2222 bitmap from buffer
 	createBitmapFromBuffer(bufferId, 1, width, height);
@@ -294,6 +294,10 @@ void VDUStreamProcessor::createBitmapFromBuffer(uint16_t bufferId, uint8_t forma
 		debug_log("vdu_sys_sprites: buffer %d not found\n\r", bufferId);
 		return;
 	}
+	if (!decompressInPlace(bufferId)) {
+		debug_log("vdu_sys_sprites: buffer %d could not be decompressed\n\r", bufferId);
+		return;
+	}
 	// is this a singular buffer we can use for a bitmap source?
 	if (buffers[bufferId].size() != 1) {
 		debug_log("vdu_sys_sprites: buffer %d is not a singular buffer and cannot be used for a bitmap source\n\r", bufferId);
@@ -335,7 +339,12 @@ void VDUStreamProcessor::createBitmapFromBuffer(uint16_t bufferId, uint8_t forma
 		debug_log("vdu_sys_sprites: buffer %d - stream length %d does not match expected length %d\n\r", bufferId, streamLength, expectedLength);
 		return;
 	}
-	auto data = stream->getBuffer();
+	// the bitmap keeps a pointer to the buffer data, so it must stay put
+	auto data = stream->pin();
+	if (!data) {
+		debug_log("vdu_sys_sprites: buffer %d - failed to pin buffer data\n\r", bufferId);
+		return;
+	}
 	if (bytesPerPixel < 1) {
 		// get our current foreground graphics colour
 		RGB888 colour;
@@ -6,12 +6,18 @@
 #include <vector>
 
 #include <Stream.h>
+#include <HardwareSerial.h>
 #include <fabgl.h>
 
 #include "agon.h"
 #include "buffers.h"
+#include "command_cache.h"
 #include "context.h"
+#include "decompression_cache.h"
+#include "profiling.h"
+#include "test_flags.h"
 #include "buffer_stream.h"
+#include "multi_buffer_stream.h"
 #include "span.h"
 #include "types.h"
 
@@ -26,6 +32,7 @@ class VDUStreamProcessor {
 		std::shared_ptr<Stream> inputStream;
 		std::shared_ptr<Stream> outputStream;
 		std::shared_ptr<Stream> originalOutputStream;
+		HardwareSerial * uart = nullptr;		// Serial link, when this processor is reading from it directly
 
 		// Graphics context storage and management
 		std::shared_ptr<Context> context;		// Current active context
@@ -33,6 +40,10 @@ class VDUStreamProcessor {
 
 		bool commandsEnabled = true;
 
+		// Input streams for buffer calls, one per call depth, reused between calls
+		std::vector<std::shared_ptr<MultiBufferStream>, psram_allocator<std::shared_ptr<MultiBufferStream>>> callStreams;
+		size_t callDepth = 0;
+
 		// Moved to public for Pingo
 		// int16_t readByte_t(uint16_t timeout);
 		// int32_t readWord_t(uint16_t timeout);
@@ -40,6 +51,7 @@ class VDUStreamProcessor {
 		// End of moved to public for Pingo
 		uint8_t readByte_b();
 		uint32_t readIntoBuffer(uint8_t * buffer, uint32_t length, uint16_t timeout);
+		uint32_t receiveIntoBuffer(uint8_t * buffer, uint32_t length, uint16_t timeout);
 		uint32_t discardBytes(uint32_t length, uint16_t timeout);
 		int16_t peekByte_t(uint16_t timeout);
 		float readFloat_t(bool is16Bit, bool isFixed, int8_t shift, uint16_t timeout);
@@ -67,6 +79,7 @@ class VDUStreamProcessor {
 		void sendColour(uint8_t colour);
 		void printBuffer(uint16_t bufferId);
 		void sendTime();
+		void sendMemoryStats(uint8_t index);
 		void vdu_sys_video_time();
 		void sendKeyboardState();
 		void vdu_sys_keystate();
@@ -109,7 +122,11 @@ class VDUStreamProcessor {
 		void sendKeycodeByte(uint8_t b, bool waitack);
 
 		void vdu_sys_buffered();
+		void vdu_sys_buffered(uint16_t bufferId, uint8_t command);
+		bool dispatchBufferedCommand(std::shared_ptr<CommandList> &commands);
 		uint32_t bufferWrite(uint16_t bufferId, uint32_t size);
+		void bufferScatterWrite(uint16_t count);
+		uint32_t bufferWriteCompressed(uint16_t bufferId, uint32_t length);
 		void bufferCall(uint16_t bufferId, AdvancedOffset offset);
 		void bufferRemoveUsers(uint16_t bufferId);
 		void bufferClear(uint16_t bufferId);
@@ -135,7 +152,10 @@ class VDUStreamProcessor {
 		void bufferTransformBitmap(uint16_t bufferId, uint8_t options, uint16_t transformBufferId, uint16_t sourceBufferId);
 		void bufferTransformData(uint16_t bufferId, uint8_t options, uint8_t format, uint16_t transformBufferId, uint16_t sourceBufferId);
 		void bufferCompress(uint16_t bufferId, uint16_t sourceBufferId);
+		void bufferCompressLZ(uint16_t bufferId, uint16_t sourceBufferId);
+		void bufferCompressParallel(uint16_t bufferId, uint16_t sourceBufferId);
 		void bufferDecompress(uint16_t bufferId, uint16_t sourceBufferId);
+		void bufferSetCompressed(uint16_t bufferId, bool compressed);
 		void bufferExpandBitmap(uint16_t bufferId, uint8_t options, uint16_t sourceBufferId);
 		
 		void bufferUsePingo3D(uint16_t bufferId);
@@ -161,6 +181,9 @@ class VDUStreamProcessor {
 				contextStack = make_shared_psram<ContextVector>();
 				contextStack->push_back(context);
 			}
+		VDUStreamProcessor(HardwareSerial *input) : VDUStreamProcessor((Stream *)input) {
+				uart = input;
+			}
 
 		int16_t readByte_t(uint16_t timeout);
 		int32_t readWord_t(uint16_t timeout);
@@ -170,6 +193,7 @@ class VDUStreamProcessor {
 			return inputStream->available() > 0;
 		}
 		inline uint8_t readByte() {
+			PROFILE_BYTES(1);
 			return inputStream->read();
 		}
 		inline void writeByte(uint8_t b) {
@@ -213,6 +237,7 @@ class VDUStreamProcessor {
 int16_t inline VDUStreamProcessor::readByte_t(uint16_t timeout = COMMS_TIMEOUT) {
 	auto read = inputStream->read();
 	if (read != -1) {
+		PROFILE_BYTES(1);
 		return read;
 	}
 
@@ -222,6 +247,7 @@ int16_t inline VDUStreamProcessor::readByte_t(uint16_t timeout = COMMS_TIMEOUT)
 	do {
 		read = inputStream->read();
 		if (read != -1) {
+			PROFILE_BYTES(1);
 			return read;
 		}
 	} while (xTaskGetTickCountFromISR() - start < timeCheck);
@@ -280,6 +306,12 @@ uint32_t VDUStreamProcessor::readIntoBuffer(uint8_t * buffer, uint32_t length, u
 		debug_log("readIntoBuffer: buffer is null\n\r");
 		return remaining;
 	}
+	if (uart && inputStream.get() == uart) {
+		return receiveIntoBuffer(buffer, length, timeout);
+	}
+	#ifdef VDP_PROFILING
+	auto start = esp_timer_get_time();
+	#endif
 
 	while (remaining > 0) {
 		auto read = inputStream->readBytes(buffer, remaining);
@@ -288,12 +320,54 @@ uint32_t VDUStreamProcessor::readIntoBuffer(uint8_t * buffer, uint32_t length, u
 			read = inputStream->readBytes(buffer, remaining);
 			if (read == 0) {
 				debug_log("readIntoBuffer: timed out\n\r");
-				return remaining;
+				break;
+			}
+		}
+		PROFILE_BYTES(read);
+		buffer += read;
+		remaining -= read;
+	}
+	PROFILE_RECEIVE(length - remaining, esp_timer_get_time() - start);
+	return remaining;
+}
+
+// Read a given number of bytes from the serial link into a buffer
+// Whatever the serial driver has already received is copied out of its receive ring in one go,
+// so the copy overlaps with the eZ80 sending the rest.  When the ring is empty we wait in the
+// driver for the next byte, for up to timeout ms, with a single retry as for readIntoBuffer
+// Returns number of remaining bytes, which will be non-zero if the read timed out
+//
+uint32_t VDUStreamProcessor::receiveIntoBuffer(uint8_t * buffer, uint32_t length, uint16_t timeout) {
+	uint32_t remaining = length;
+	auto streamTimeout = uart->getTimeout();
+	uart->setTimeout(timeout);
+	#ifdef VDP_PROFILING
+	auto start = esp_timer_get_time();
+	#endif
+
+	auto receive = [&]() -> size_t {
+		size_t available = uart->available();
+		return available > 0
+			? uart->read(buffer, std::min<size_t>(available, remaining))
+			: uart->readBytes(buffer, 1);
+	};
+	while (remaining > 0) {
+		auto read = receive();
+		if (read == 0) {
+			// timed out - perform a single retry
+			read = receive();
+			if (read == 0) {
+				debug_log("receiveIntoBuffer: timed out\n\r");
+				break;
 			}
 		}
+		PROFILE_BYTES(read);
 		buffer += read;
 		remaining -= read;
 	}
+
+	uart->setTimeout(streamTimeout);
+	PROFILE_RECEIVE(length - remaining, esp_timer_get_time() - start);
 	return remaining;
 }
 
@@ -436,7 +510,12 @@ void VDUStreamProcessor::sendMouseData(MouseDelta * delta = nullptr) {
 // Process all available commands from the stream
 //
 void VDUStreamProcessor::processAllAvailable() {
+	auto fastDispatch = isTestFlagSet(TEST_FLAG_FAST_DISPATCH);
+	std::shared_ptr<CommandList> commands;
 	while (byteAvailable()) {
+		if (fastDispatch && dispatchBufferedCommand(commands)) {
+			continue;
+		}
 		vdu(readByte());
 	}
 }
@@ -130,6 +130,7 @@ void VDUStreamProcessor::vdu_sys() {
 //
 void VDUStreamProcessor::vdu_sys_video() {
 	auto mode = readByte_t();
+	PROFILE_SCOPE(PROFILE_VDP, mode);
 
 	switch (mode) {
 		case VDP_CURSOR_VSTART: {		// VDU 23, 0, &0A, offset
@@ -323,6 +324,22 @@ void VDUStreamProcessor::vdu_sys_video() {
 				context->setDottedLinePatternLength(b);
 			}
 		}	break;
+		case VDP_MEMORY_STATS: {		// VDU 23, 0, &F6, index
+			auto index = readByte_t();	// Report memory pool and heap statistics
+			if (index == MEMORY_STATS_LOG) {
+				psramPool.report();
+			} else if (index >= 0) {
+				sendMemoryStats(index);
+			}
+		}	break;
+		case VDP_PROFILE: {				// VDU 23, 0, &F7, command
+			auto command = readByte_t();	// Profiling statistics
+			if (command == PROFILE_RESET) {
+				resetProfile();
+			} else if (command == PROFILE_REPORT) {
+				reportProfile();
+			}
+		}	break;
 		case VDP_TESTFLAG_SET: {		// VDU 23, 0, &F8, flag; value;
 			auto flag = readWord_t();	// Set a test flag
 			auto value = readWord_t();
@@ -477,6 +494,38 @@ void VDUStreamProcessor::sendModeInformation() {
 	send_packet(PACKET_MODE, sizeof packet, packet);
 }
 
+// VDU 23, 0, &F6, index: Send memory pool statistics for a size class
+// along with the free space on the PSRAM heap
+// Classes past the last have a slot size of 0
+//
+void VDUStreamProcessor::sendMemoryStats(uint8_t index) {
+	auto stats = psramPool.getStats(index);
+	uint32_t heapFree = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+	uint32_t heapLargest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+	uint8_t packet[] = {
+		index,
+		(uint8_t) (stats.slotSize & 0xFF),			// Slot size in bytes
+		(uint8_t) ((stats.slotSize >> 8) & 0xFF),
+		(uint8_t) (stats.pages & 0xFF),				// Pages held by the class
+		(uint8_t) ((stats.pages >> 8) & 0xFF),
+		(uint8_t) (stats.used & 0xFF),				// Slots in use
+		(uint8_t) ((stats.used >> 8) & 0xFF),
+		(uint8_t) ((stats.used >> 16) & 0xFF),
+		(uint8_t) (stats.free & 0xFF),				// Free slots
+		(uint8_t) ((stats.free >> 8) & 0xFF),
+		(uint8_t) ((stats.free >> 16) & 0xFF),
+		(uint8_t) (heapFree & 0xFF),				// Free bytes on the PSRAM heap
+		(uint8_t) ((heapFree >> 8) & 0xFF),
+		(uint8_t) ((heapFree >> 16) & 0xFF),
+		(uint8_t) ((heapFree >> 24) & 0xFF),
+		(uint8_t) (heapLargest & 0xFF),				// Largest free extent on the PSRAM heap
+		(uint8_t) ((heapLargest >> 8) & 0xFF),
+		(uint8_t) ((heapLargest >> 16) & 0xFF),
+		(uint8_t) ((heapLargest >> 24) & 0xFF),
+	};
+	send_packet(PACKET_MEMORY_STATS, sizeof packet, packet);
+}
+
 // VDU 23, 0, &87, <mode>, [args]: Handle time requests
 //
 void VDUStreamProcessor::vdu_sys_video_time() {